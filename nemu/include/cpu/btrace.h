@@ -0,0 +1,123 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_BTRACE_H__
+#define __CPU_BTRACE_H__
+
+#include <isa.h>
+#include <memory/mtrace.h>
+
+/* Binary instruction trace. Each instruction is recorded as a fixed-size
+ * record into a ring buffer, which always holds the last records. When the
+ * ring wraps, the records inside [CONFIG_TRACE_START, CONFIG_TRACE_END] are
+ * copied into a queue, and a writer thread compresses them into the trace
+ * file. Use tools/btrace to decode them.
+ *
+ * A trace file starts with BTraceHeader. Without BTRACE_COMPRESSED (e.g. a
+ * dump of the ring buffer), the records follow as they are. Otherwise,
+ * blocks follow, each of which is a BTraceBlock and the compressed
+ * records of a chunk. A block is decoded on its own:
+ *   - each record starts with a tag byte of BTRACE_TAG_* flags
+ *   - the pc is encoded as a varint of the zigzag difference from the
+ *     fall-through pc (pc + len) of the previous record, if it differs
+ *   - the instruction and its length are looked up in a dictionary
+ *     indexed by the pc, and written as 5 bytes only when they miss
+ *   - the result is a varint of the zigzag difference from the previous
+ *     result, if BTRACE_TAG_RESULT
+ * and the whole block is then compressed with LZ4-style sequences. The
+ * file ends with the index of blocks, a BTraceIndex for each block and a
+ * BTraceFooter, to find the block of an instruction without decoding the
+ * blocks before it. A trace cut off by a crash has no index, and it is
+ * decoded by scanning the blocks. The memory access trace uses the same
+ * header, with BTRACE_MEM and records which are never compressed, and its
+ * records are queued to the same writer thread.
+ *
+ * Keep them in sync with tools/btrace/btrace-decode.c.
+ */
+typedef struct {
+  char magic[8];      // "NEMUBTRC"
+  uint32_t version;
+  uint32_t rec_size;  // sizeof(BTraceRecord)
+  char isa[16];
+  uint32_t word_size; // sizeof(word_t)
+  uint32_t flags;
+  uint64_t first;     // index of the first record
+} BTraceHeader;
+
+typedef struct {
+  uint32_t nr;        // number of records
+  uint32_t raw_size;  // size of the records before compression
+  uint32_t size;      // size of the compressed data
+  uint32_t pad;
+  uint64_t first;     // index of the first record
+} BTraceBlock;
+
+typedef struct {
+  uint64_t first;
+  uint64_t offset;
+} BTraceIndex;
+
+typedef struct {
+  uint64_t nr_block;
+  uint64_t index_offset;
+  char magic[8];      // "BTRCINDX"
+} BTraceFooter;
+
+#define BTRACE_MAGIC "NEMUBTRC"
+#define BTRACE_INDEX_MAGIC "BTRCINDX"
+#define BTRACE_VERSION 3
+#define BTRACE_HAS_RESULT  1 // records may carry a result
+#define BTRACE_COMPRESSED  2
+#define BTRACE_MEM         4 // records are MTraceRecord, see include/memory/mtrace.h
+
+#define BTRACE_TAG_SEQ   1 // pc is the fall-through of the previous record
+#define BTRACE_TAG_DICT  2 // the instruction is found in the dictionary
+#define BTRACE_TAG_RESULT 4 // the record has a result
+#define BTRACE_DICT_SIZE 4096
+#define BTRACE_DICT_IDX(pc) (((pc) >> 1) % BTRACE_DICT_SIZE)
+
+typedef struct {
+  word_t pc;
+  uint32_t inst;
+  uint8_t len;   // length of the instruction
+  bool has_result; // the instruction writes a destination register
+  word_t result; // value of the destination register after execution
+} BTraceRecord;
+
+#ifdef CONFIG_BTRACE
+#define BTRACE_RING_SIZE (1 << CONFIG_BTRACE_RING_SHIFT)
+
+extern BTraceRecord btrace_ring[BTRACE_RING_SIZE];
+extern uint64_t btrace_nr; // number of records so far
+
+void init_btrace(const char *file);
+void btrace_wrap();
+void btrace_dump();
+void btrace_start_writer();
+void btrace_push_mem(FILE *fp, const MTraceRecord *rec, int nr);
+void btrace_sync();
+
+static inline void btrace_record(word_t pc, uint32_t inst, int len, bool has_result, word_t result) {
+  BTraceRecord *r = &btrace_ring[btrace_nr % BTRACE_RING_SIZE];
+  r->pc = pc;
+  r->inst = inst;
+  r->len = len;
+  r->has_result = has_result;
+  r->result = (has_result ? result : 0);
+  if (unlikely(++ btrace_nr % BTRACE_RING_SIZE == 0)) btrace_wrap();
+}
+#endif
+
+#endif
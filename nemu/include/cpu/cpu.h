@@ -19,10 +19,40 @@
 #include <common.h>
 
 void cpu_exec(uint64_t n);
+void cpu_replay(uint64_t n);
+bool cpu_replay_events(uint64_t n);
+void quiet_stop();
+extern bool g_replay; // in cpu_replay()
+extern bool g_quiet;  // in cpu_replay_events()
 
 void set_nemu_state(int state, vaddr_t pc, int halt_ret);
 void invalid_inst(vaddr_t thispc);
 
+#ifdef CONFIG_ENGINE_JIT
+void jit_init();
+uint64_t jit_exec(uint64_t n);
+void jit_flush();
+void jit_update_watch();
+#endif
+
+/* Breakpoints of sdb. The pcs with breakpoints are kept in a bitmap
+ * indexed by the low bits of pc, so that the execute loop only tests a
+ * bit before each instruction, and calls bp_check() when it is set. The
+ * threaded and JIT engines end their blocks before the pcs in the bitmap.
+ */
+#ifdef CONFIG_BREAKPOINT
+#define BP_MAP_BITS 16
+#define BP_MAP_IDX(pc) (((pc) >> 1) & ((1 << BP_MAP_BITS) - 1))
+
+extern uint64_t bp_map[(1 << BP_MAP_BITS) / 64];
+void bp_check(vaddr_t pc);
+
+static inline bool bp_maybe(vaddr_t pc) {
+  uint32_t idx = BP_MAP_IDX(pc);
+  return (bp_map[idx / 64] >> (idx % 64)) & 1;
+}
+#endif
+
 #define NEMUTRAP(thispc, code) set_nemu_state(NEMU_END, thispc, code)
 #define INV(thispc) invalid_inst(thispc)
 
@@ -22,6 +22,7 @@ typedef struct Decode {
   vaddr_t pc;
   vaddr_t snpc; // static next pc
   vaddr_t dnpc; // dynamic next pc
+  const void *exec; // handler of the decoded instruction
   ISADecodeInfo isa;
   IFDEF(CONFIG_ITRACE, char logbuf[128]);
 } Decode;
@@ -87,6 +88,24 @@ finish:
 
 
 // --- pattern matching wrappers for decode ---
+#ifdef CONFIG_DECODE_TREE
+// The decision tree generated by tools/gen-decode returns the line number of
+// the first pattern matching the instruction, and each INSTPAT() is a `case`
+// labeled with its own line number. The order of patterns is still respected.
+#include <isa-decode-tree.h>
+
+#define INSTPAT(pattern, ...) do { \
+  if (0) { \
+  case __LINE__: \
+    INSTPAT_MATCH(s, ##__VA_ARGS__); \
+    goto *(__instpat_end); \
+  } \
+} while (0)
+
+#define INSTPAT_START(name) { const void * __instpat_end = &&concat(__instpat_end_, name); \
+  switch (concat(__instpat_tree_, __LINE__)((uint64_t)INSTPAT_INST(s))) { default: ;
+#define INSTPAT_END(name)   } concat(__instpat_end_, name): ; }
+#else
 #define INSTPAT(pattern, ...) do { \
   uint64_t key, mask, shift; \
   pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
@@ -98,5 +117,21 @@ finish:
 
 #define INSTPAT_START(name) { const void * __instpat_end = &&concat(__instpat_end_, name);
 #define INSTPAT_END(name)   concat(__instpat_end_, name): ; }
+#endif
+
+// --- decoded instruction cache ---
+#ifdef CONFIG_DCACHE
+bool dcache_lookup(Decode *s);
+void dcache_insert(Decode *s);
+void dcache_init();
+void dcache_flush();
+#endif
+
+// --- translated block cache ---
+#ifdef CONFIG_ENGINE_THREADED
+uint64_t tcache_exec(uint64_t n, Decode **last);
+void tcache_init();
+void tcache_flush();
+#endif
 
 #endif
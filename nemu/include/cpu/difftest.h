@@ -24,6 +24,9 @@ void difftest_skip_ref();
 void difftest_skip_dut(int nr_ref, int nr_dut);
 void difftest_set_patch(void (*fn)(void *arg), void *arg);
 void difftest_step(vaddr_t pc, vaddr_t npc);
+void difftest_store(paddr_t addr, int len, word_t data);
+void difftest_sync();
+void difftest_reload();
 void difftest_detach();
 void difftest_attach();
 #else
@@ -31,6 +34,8 @@ static inline void difftest_skip_ref() {}
 static inline void difftest_skip_dut(int nr_ref, int nr_dut) {}
 static inline void difftest_set_patch(void (*fn)(void *arg), void *arg) {}
 static inline void difftest_step(vaddr_t pc, vaddr_t npc) {}
+static inline void difftest_sync() {}
+static inline void difftest_reload() {}
 static inline void difftest_detach() {}
 static inline void difftest_attach() {}
 #endif
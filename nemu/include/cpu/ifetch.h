@@ -14,11 +14,31 @@
 ***************************************************************************************/
 
 #ifndef __CPU_IFETCH_H__
+#define __CPU_IFETCH_H__
 
 #include <memory/vaddr.h>
 
+/* The page instructions are being fetched from. Fetches inside it read
+ * the host memory directly until the PC leaves the page. The window reads
+ * the guest memory itself, so stores to the page are seen at once, and it
+ * is only dropped when the mapping changes (see vaddr_flush()).
+ */
+typedef struct {
+  vaddr_t page; // guest page, or an unaligned value if invalid
+  uint8_t *host;
+} IFetchWindow;
+
+extern IFetchWindow ifetch_win;
+word_t inst_fetch_slow(vaddr_t pc, int len);
+
 static inline uint32_t inst_fetch(vaddr_t *pc, int len) {
-  uint32_t inst = vaddr_ifetch(*pc, len);
+  vaddr_t off = *pc & PAGE_MASK;
+  uint32_t inst;
+  if (likely((*pc ^ off) == ifetch_win.page && off <= PAGE_SIZE - len)) {
+    inst = host_read(ifetch_win.host + off, len);
+  } else {
+    inst = inst_fetch_slow(*pc, len);
+  }
   (*pc) += len;
   return inst;
 }
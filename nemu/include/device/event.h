@@ -0,0 +1,38 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include <common.h>
+
+#define TIMER_HZ 60
+
+// number of guest instructions in one period of `hz`
+#define EVENT_PERIOD(hz) ((uint64_t)CONFIG_DEVICE_INST_PER_SEC / (hz))
+
+typedef void (*event_handler_t) ();
+
+/* Events are keyed on the guest instruction count. An event with a
+ * non-zero `period` is rescheduled after it fires.
+ */
+void add_event(event_handler_t h, uint64_t delay, uint64_t period);
+void event_run(uint64_t now);
+void event_reload(uint64_t now);
+
+// deadline of the earliest event, checked by the execution loop
+extern uint64_t g_event_deadline;
+
+#endif
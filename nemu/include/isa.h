@@ -32,10 +32,15 @@ void init_isa();
 extern CPU_state cpu;
 void isa_reg_display();
 word_t isa_reg_str2val(const char *name, bool *success);
+word_t* isa_reg_str2ptr(const char *name);
 
 // exec
 struct Decode;
 int isa_exec_once(struct Decode *s);
+#ifdef CONFIG_ENGINE_THREADED
+bool isa_decode_once(struct Decode *s);
+int isa_exec_block(struct Decode *s, int n);
+#endif
 
 // memory
 enum { MMU_DIRECT, MMU_TRANSLATE, MMU_FAIL };
@@ -45,6 +50,7 @@ enum { MEM_RET_OK, MEM_RET_FAIL, MEM_RET_CROSS_PAGE };
 int isa_mmu_check(vaddr_t vaddr, int len, int type);
 #endif
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type);
+void isa_mmu_flush();
 
 // interrupt/exception
 vaddr_t isa_raise_intr(word_t NO, vaddr_t epc);
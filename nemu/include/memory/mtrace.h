@@ -0,0 +1,68 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __MEMORY_MTRACE_H__
+#define __MEMORY_MTRACE_H__
+
+#include <common.h>
+
+/* Memory access tracer. Loads and stores (not instruction fetches) to the
+ * physical ranges added by mtrace_add() are recorded. The ranges are also
+ * kept in a bitmap of pages, indexed by the low bits of the page number,
+ * so that an access to an untraced page only costs a test of the bitmap.
+ * Traced pages are never cached in the soft TLB, so all accesses to them
+ * take the slow path, where the bitmap is tested.
+ *
+ * With --mtrace=FILE, the records are written to FILE in the format of
+ * the binary trace (see include/cpu/btrace.h) with BTRACE_MEM, otherwise
+ * they are written to the log. The records for FILE are gathered into
+ * chunks, which are written by the writer thread of the binary trace.
+ */
+typedef struct {
+  uint64_t addr;  // physical address
+  word_t pc;
+  word_t data;
+  uint8_t len;
+  uint8_t type;   // MTRACE_* flags
+} MTraceRecord;
+
+#define MTRACE_WRITE 1
+#define MTRACE_MMIO  2
+
+#ifdef CONFIG_MTRACE
+#define MTRACE_MAP_BITS 20
+
+extern uint64_t mtrace_map[(1 << MTRACE_MAP_BITS) / 64];
+
+static inline bool mtrace_page(paddr_t addr) {
+  uint32_t pg = (addr >> 12) & ((1 << MTRACE_MAP_BITS) - 1);
+  return (mtrace_map[pg / 64] >> (pg % 64)) & 1;
+}
+
+void mtrace_access(paddr_t addr, int len, word_t data, bool is_write);
+
+// called after each load and store reaching the physical memory or MMIO
+static inline void mtrace(paddr_t addr, int len, word_t data, bool is_write) {
+  if (unlikely(mtrace_page(addr) | mtrace_page(addr + len - 1))) mtrace_access(addr, len, data, is_write);
+}
+
+void init_mtrace(const char *file);
+void mtrace_flush();
+bool mtrace_add(paddr_t start, paddr_t end); // [start, end]
+bool mtrace_del(int id);
+void mtrace_display();
+#endif
+
+#endif
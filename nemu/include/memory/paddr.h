@@ -31,7 +31,32 @@ static inline bool in_pmem(paddr_t addr) {
   return addr - CONFIG_MBASE < CONFIG_MSIZE;
 }
 
+void pmem_prepare(paddr_t addr, size_t len);
+void pmem_prepare_overwrite(paddr_t addr, size_t len);
+bool pmem_touched(paddr_t addr);
+void pmem_remapped();
+
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
 
+/* Code pages. A cache of decoded or translated guest code registers a
+ * hook, which is called with the written range on stores to pmem pages
+ * marked as code. A page stays marked once code is fetched from it.
+ */
+typedef void (*code_hook_t)(paddr_t addr, int len);
+void paddr_add_code_hook(code_hook_t hook);
+bool paddr_mark_code(paddr_t addr);
+bool paddr_is_code(paddr_t addr);
+
+/* Data watchpoints. Stores to the pmem pages marked by paddr_watch()
+ * call the watch hook with the old and new data before they are done.
+ * Like code pages, watched pages are never cached by the soft TLB for
+ * writes, so that the stores reach paddr_write().
+ */
+typedef void (*watch_hook_t)(paddr_t addr, int len, word_t old, word_t data);
+void paddr_set_watch_hook(watch_hook_t hook);
+bool paddr_watch(paddr_t addr, word_t len);
+void paddr_unwatch_all();
+bool paddr_is_watched(paddr_t addr);
+
 #endif
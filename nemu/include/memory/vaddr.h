@@ -17,13 +17,62 @@
 #define __MEMORY_VADDR_H__
 
 #include <common.h>
-
-word_t vaddr_ifetch(vaddr_t addr, int len);
-word_t vaddr_read(vaddr_t addr, int len);
-void vaddr_write(vaddr_t addr, int len, word_t data);
+#include <isa.h>
+#include <memory/host.h>
 
 #define PAGE_SHIFT        12
 #define PAGE_SIZE         (1ul << PAGE_SHIFT)
 #define PAGE_MASK         (PAGE_SIZE - 1)
 
+/* Software TLB caching the host address of guest pages, with separate
+ * entries for instruction fetch, read and write (indexed by MEM_TYPE_*).
+ * An entry only hits aligned accesses, which never cross its page. Pages
+ * not backed by pmem (e.g. MMIO) are never cached, so they always take
+ * the slow path. Neither are code pages for writes, so that stores to
+ * code reach paddr_write() and invalidate the cached code, nor watched
+ * pages for writes, nor the pages traced by mtrace, nor any page for
+ * writes with the pipelined difftest, which records every store.
+ */
+#define STLB_BITS 8
+#define STLB_SIZE (1 << STLB_BITS)
+#define STLB_INVALID ((vaddr_t)PAGE_MASK) // never equal to a masked address
+
+typedef struct {
+  vaddr_t tag;      // guest page, or STLB_INVALID
+  uintptr_t addend; // host address = guest address + addend
+} STLBEntry;
+
+extern STLBEntry stlb[3][STLB_SIZE];
+
+static inline STLBEntry* stlb_entry(int type, vaddr_t addr) {
+  return &stlb[type][(addr >> PAGE_SHIFT) & (STLB_SIZE - 1)];
+}
+
+static inline bool stlb_hit(STLBEntry *e, vaddr_t addr, int len) {
+  return e->tag == (addr & (~(vaddr_t)PAGE_MASK | (len - 1)));
+}
+
+void stlb_flush();
+void vaddr_flush();
+word_t vaddr_read_slow(vaddr_t addr, int len, int type);
+void vaddr_write_slow(vaddr_t addr, int len, word_t data);
+
+static inline word_t vaddr_ifetch(vaddr_t addr, int len) {
+  STLBEntry *e = stlb_entry(MEM_TYPE_IFETCH, addr);
+  if (likely(stlb_hit(e, addr, len))) return host_read((void *)(addr + e->addend), len);
+  return vaddr_read_slow(addr, len, MEM_TYPE_IFETCH);
+}
+
+static inline word_t vaddr_read(vaddr_t addr, int len) {
+  STLBEntry *e = stlb_entry(MEM_TYPE_READ, addr);
+  if (likely(stlb_hit(e, addr, len))) return host_read((void *)(addr + e->addend), len);
+  return vaddr_read_slow(addr, len, MEM_TYPE_READ);
+}
+
+static inline void vaddr_write(vaddr_t addr, int len, word_t data) {
+  STLBEntry *e = stlb_entry(MEM_TYPE_WRITE, addr);
+  if (likely(stlb_hit(e, addr, len))) { host_write((void *)(addr + e->addend), len, data); return; }
+  vaddr_write_slow(addr, len, data);
+}
+
 #endif
@@ -34,6 +34,42 @@ extern NEMUState nemu_state;
 
 uint64_t get_time();
 
+// ----------- checkpoint -----------
+
+/* Device state saved in checkpoints besides the CPU and pmem. Each part
+ * is registered once during initialization, and restored in the same
+ * order. `post_load` is called after it is restored, if not NULL.
+ */
+#ifndef CONFIG_TARGET_AM
+void checkpoint_add(const char *name, void *ptr, size_t size, void (*post_load)());
+bool checkpoint_save(const char *file);
+bool checkpoint_load(const char *file);
+#else
+static inline void checkpoint_add(const char *name, void *ptr, size_t size, void (*post_load)()) {}
+#endif
+
+// ----------- elf -----------
+
+typedef struct {
+  vaddr_t addr;
+  word_t size;
+  const char *name;
+  bool is_func;
+} Symbol;
+
+/* Load an ELF image, and return the size of memory from RESET_VECTOR it
+ * occupies, or -1 if it is not an ELF file. Its function and object
+ * symbols are kept for the tracers.
+ */
+#ifndef CONFIG_TARGET_AM
+long elf_load(const char *file);
+const Symbol* symbol_lookup(vaddr_t addr);
+const Symbol* symbol_find(const char *name);
+#else
+static inline const Symbol* symbol_lookup(vaddr_t addr) { return NULL; }
+static inline const Symbol* symbol_find(const char *name) { return NULL; }
+#endif
+
 // ----------- log -----------
 
 #define ANSI_FG_BLACK   "\33[1;30m"
@@ -56,21 +92,30 @@ uint64_t get_time();
 
 #define ANSI_FMT(str, fmt) fmt str ANSI_NONE
 
+// suppress log_write() while replaying
+void log_mute(bool mute);
+
+// records are written to the log file asynchronously, see log.c
+void log_printf(const char *fmt, ...);
+void log_flush();
+
 #define log_write(...) IFDEF(CONFIG_TARGET_NATIVE_ELF, \
   do { \
     extern FILE* log_fp; \
     extern bool log_enable(); \
     if (log_enable() && log_fp != NULL) { \
-      fprintf(log_fp, __VA_ARGS__); \
-      fflush(log_fp); \
+      log_printf(__VA_ARGS__); \
     } \
   } while (0) \
 )
 
+// print to stdout, and also to the log file if it is not stdout
 #define _Log(...) \
   do { \
     printf(__VA_ARGS__); \
-    log_write(__VA_ARGS__); \
+    IFDEF(CONFIG_TARGET_NATIVE_ELF, \
+      extern FILE* log_fp; \
+      if (log_fp != stdout) log_write(__VA_ARGS__)); \
   } while (0)
 
 
@@ -43,6 +43,9 @@ $(OBJ_DIR)/%.o: %.cc
 # Depencies
 -include $(OBJS:.o=.d)
 
+# Generated headers should exist before compiling any object
+$(OBJS): | $(GEN_HEADERS)
+
 # Some convenient rules
 
 .PHONY: app clean
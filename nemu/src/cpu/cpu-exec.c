@@ -16,6 +16,8 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <cpu/btrace.h>
+#include <device/event.h>
 #include <locale.h>
 
 /* The assembly code of instructions executed is only output to the screen
@@ -29,23 +31,54 @@ CPU_state cpu = {};
 uint64_t g_nr_guest_inst = 0;
 static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
+bool g_replay = false;
+bool g_quiet = false;
+static bool quiet_stopped = false;
 
-void device_update();
 void traver_trace_diff();
+extern int g_nr_wp;
+
+#ifdef CONFIG_BTRACE
+// the destination register of the instruction, or -1 if it has none
+static int btrace_rd(uint32_t inst, int len) {
+#ifdef CONFIG_ISA_riscv
+  uint32_t opcode = BITS(inst, 6, 0);
+  // store, branch, fence, and ecall/ebreak/mret
+  if (opcode == 0x23 || opcode == 0x63 || opcode == 0x0f ||
+      (opcode == 0x73 && BITS(inst, 14, 12) == 0)) return -1;
+  int rd = BITS(inst, 11, 7);
+  return (len == 4 && rd != 0 ? rd % ARRLEN(cpu.gpr) : -1);
+#else
+  return -1;
+#endif
+}
+#endif
 
 static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
 #ifdef CONFIG_ITRACE_COND
   if (ITRACE_COND) { log_write("%s\n", _this->logbuf); }
 #endif
   if (g_print_step) { IFDEF(CONFIG_ITRACE, puts(_this->logbuf)); }
+#ifdef CONFIG_BTRACE
+  uint32_t inst;
+  memcpy(&inst, &_this->isa.inst, sizeof(inst));
+  int len = _this->snpc - _this->pc;
+  int rd = btrace_rd(inst, len);
+  btrace_record(_this->pc, inst, len, rd != -1, MUXDEF(CONFIG_ISA_riscv, cpu.gpr[rd < 0 ? 0 : rd], 0));
+#endif
   IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
 
-	//扫描监视点
-	//等待实现 IFDEF(CONFIG_WATCHPOINT, traver_trace_diff());
-	
-	//traver_trace_diff();
+	//扫描监视点, 重放时由调用者自己检查
+#ifdef CONFIG_WATCHPOINT
+	if (unlikely(g_nr_wp > 0) && !g_replay) traver_trace_diff();
+#endif
+	//下一条指令处的断点
+#ifdef CONFIG_BREAKPOINT
+	if (unlikely(bp_maybe(dnpc)) && !g_replay) bp_check(dnpc);
+#endif
 }
 
+#ifndef CONFIG_ENGINE_THREADED
 static void exec_once(Decode *s, vaddr_t pc) {
   s->pc = pc;
   s->snpc = pc;
@@ -76,17 +109,92 @@ static void exec_once(Decode *s, vaddr_t pc) {
       MUXDEF(CONFIG_ISA_x86, s->snpc, s->pc), (uint8_t *)&s->isa.inst, ilen);
 #endif
 }
+#endif
+
+// number of instructions to run before the next device event, a batch
+// also ends where the trace window opens or closes, since log_enable()
+// only sees the counter updated once per batch
+static inline uint64_t batch_size(uint64_t n) {
+#ifdef CONFIG_DEVICE
+  uint64_t left = g_event_deadline - g_nr_guest_inst;
+  if (left < n) n = left;
+#endif
+#ifdef CONFIG_TRACE
+  // the next instruction is the (g_nr_guest_inst + 1)-th one
+  uint64_t edge = (g_nr_guest_inst + 1 < CONFIG_TRACE_START ? CONFIG_TRACE_START - 1 : CONFIG_TRACE_END);
+  if (g_nr_guest_inst < edge && edge - g_nr_guest_inst < n) n = edge - g_nr_guest_inst;
+#endif
+  return n;
+}
+
+// difftest and expression watchpoints check the state after each
+// instruction, while translated code ends before the breakpoints and
+// stops after a store hitting an address watchpoint
+static inline bool single_step() {
+#ifdef CONFIG_DIFFTEST
+  return true;
+#else
+  return MUXDEF(CONFIG_WATCHPOINT, g_nr_wp > 0, false);
+#endif
+}
+
+// fire the device events which are due
+static inline void device_poll() {
+  IFDEF(CONFIG_DEVICE, if (g_nr_guest_inst >= g_event_deadline) event_run(g_nr_guest_inst));
+}
 
 static void execute(uint64_t n) {
+#ifdef CONFIG_ENGINE_THREADED
+  // leave the translated code only at block ends,
+  // or after each instruction for difftest, watchpoints and breakpoints
+  while (n > 0) {
+    device_poll();
+    if (nemu_state.state != NEMU_RUNNING) break;
+    Decode *s = NULL;
+    uint64_t nr = tcache_exec(single_step() ? 1 : batch_size(n), &s);
+    g_nr_guest_inst += nr;
+    n -= nr;
+    trace_and_difftest(s, cpu.pc);
+    if (nemu_state.state != NEMU_RUNNING) break;
+  }
+#elif defined(CONFIG_ENGINE_JIT)
+  // run translated code when it is available, and interpret otherwise
+  Decode s;
+  while (n > 0) {
+    device_poll();
+    if (nemu_state.state != NEMU_RUNNING) break;
+    uint64_t nr = (single_step() ? 0 : jit_exec(batch_size(n)));
+#ifdef CONFIG_BREAKPOINT
+    if (nr > 0 && unlikely(bp_maybe(cpu.pc)) && !g_replay) bp_check(cpu.pc);
+#endif
+    if (nr == 0) {
+      exec_once(&s, cpu.pc);
+      nr = 1;
+      trace_and_difftest(&s, cpu.pc);
+    }
+    g_nr_guest_inst += nr;
+    n -= nr;
+    if (nemu_state.state != NEMU_RUNNING) break;
+  }
+#else
+  // the instruction counter is updated once per batch, and a batch
+  // ends at the deadline of the next device event
   Decode s;
-  for (;n > 0; n --) {
-    exec_once(&s, cpu.pc);
-    g_nr_guest_inst ++;
-		//调用trace_and_difftest
-    trace_and_difftest(&s, cpu.pc);
+  while (n > 0) {
+    device_poll();
+    if (nemu_state.state != NEMU_RUNNING) break;
+    uint64_t batch = batch_size(n), nr = 0;
+    while (nr < batch) {
+      exec_once(&s, cpu.pc);
+      nr ++;
+      trace_and_difftest(&s, cpu.pc);
+      if (nemu_state.state != NEMU_RUNNING) break;
+    }
+    g_nr_guest_inst += nr;
+    n -= nr;
     if (nemu_state.state != NEMU_RUNNING) break;
-    IFDEF(CONFIG_DEVICE, device_update());
   }
+#endif
 }
 
 static void statistic() {
@@ -100,12 +208,14 @@ static void statistic() {
 
 void assert_fail_msg() {
   isa_reg_display();
+  IFDEF(CONFIG_BTRACE, btrace_dump());
   statistic();
+  IFNDEF(CONFIG_TARGET_AM, log_flush());
 }
 
 /* Simulate how the CPU works. */
 void cpu_exec(uint64_t n) {
-  g_print_step = (n < MAX_INST_TO_PRINT);
+  g_print_step = (n < MAX_INST_TO_PRINT) && !g_replay && !g_quiet;
   switch (nemu_state.state) {
     case NEMU_END: case NEMU_ABORT: case NEMU_QUIT:
       printf("Program execution has ended. To restart the program, exit NEMU and run again.\n");
@@ -116,6 +226,7 @@ void cpu_exec(uint64_t n) {
   uint64_t timer_start = get_time();
 
   execute(n);
+  difftest_sync();
 
   uint64_t timer_end = get_time();
   g_timer += timer_end - timer_start;
@@ -123,13 +234,46 @@ void cpu_exec(uint64_t n) {
   switch (nemu_state.state) {
     case NEMU_RUNNING: nemu_state.state = NEMU_STOP; break;
 
-    case NEMU_END: case NEMU_ABORT:
+    case NEMU_ABORT: IFDEF(CONFIG_BTRACE, btrace_dump());
+      // fall through
+    case NEMU_END:
       Log("nemu: %s at pc = " FMT_WORD,
           (nemu_state.state == NEMU_ABORT ? ANSI_FMT("ABORT", ANSI_FG_RED) :
            (nemu_state.halt_ret == 0 ? ANSI_FMT("HIT GOOD TRAP", ANSI_FG_GREEN) :
             ANSI_FMT("HIT BAD TRAP", ANSI_FG_RED))),
           nemu_state.halt_pc);
       // fall through
-    case NEMU_QUIT: statistic();
+    case NEMU_QUIT: statistic(); IFNDEF(CONFIG_TARGET_AM, log_flush());
   }
 }
+
+/* Run `n` instructions without printing or tracing them. This is used
+ * to replay the execution from a snapshot up to an earlier point.
+ */
+void cpu_replay(uint64_t n) {
+  g_replay = true;
+  IFNDEF(CONFIG_TARGET_AM, log_mute(true));
+  cpu_exec(n);
+  IFNDEF(CONFIG_TARGET_AM, log_mute(false));
+  g_replay = false;
+}
+
+// called instead of reporting a watchpoint or a breakpoint in cpu_replay_events()
+void quiet_stop() {
+  nemu_state.state = NEMU_STOP;
+  quiet_stopped = true;
+}
+
+/* Replay like cpu_replay(), but the watchpoints and the breakpoints still
+ * stop NEMU, without any output. Return whether NEMU is stopped by them,
+ * so that the replay runs at full speed from one of them to the next.
+ */
+bool cpu_replay_events(uint64_t n) {
+  g_quiet = true;
+  quiet_stopped = false;
+  IFNDEF(CONFIG_TARGET_AM, log_mute(true));
+  cpu_exec(n);
+  IFNDEF(CONFIG_TARGET_AM, log_mute(false));
+  g_quiet = false;
+  return quiet_stopped;
+}
@@ -18,6 +18,7 @@
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <utils.h>
 #include <difftest-def.h>
 
@@ -31,6 +32,275 @@ void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
 static bool is_skip_ref = false;
 static int skip_dut_nr_inst = 0;
 
+#if CONFIG_DIFFTEST_BATCH > 1
+/* DUT runs a window of CONFIG_DIFFTEST_BATCH instructions, then REF runs
+ * them at once and the registers are compared. On a mismatch, NEMU rewinds
+ * to the last difftest snapshot and compares after every instruction up
+ * to the end of the failed window, which finds the first diverging one.
+ */
+bool snapshot_take_diff(uint64_t *target);
+bool snapshot_has_diff();
+void snapshot_rewind_diff(uint64_t target);
+
+static uint64_t nr_inst = 0;    // instructions run in windows
+static uint64_t nr_pending = 0; // instructions run by DUT but not by REF yet
+static uint64_t bisect_end = 0; // after rewinding, compare every instruction up to here
+
+// let REF catch up with DUT, and compare the registers
+static void check_window(vaddr_t pc) {
+  CPU_state ref_r;
+  uint64_t start = nr_inst - nr_pending;
+  ref_difftest_exec(nr_pending);
+  nr_pending = 0;
+  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+  if (isa_difftest_checkregs(&ref_r, pc)) {
+    if (bisect_end == 0 || nr_inst < bisect_end) return;
+    Log("The mismatch is not reproduced after rewinding, DUT or REF may be nondeterministic");
+  } else if (bisect_end == 0 && snapshot_has_diff()) {
+    Log("Rewind to find the first diverging instruction in (%" PRIu64 ", %" PRIu64 "]",
+        start, nr_inst);
+    snapshot_rewind_diff(nr_inst);
+  }
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = pc;
+  isa_reg_display();
+}
+
+static void batch_step(vaddr_t pc) {
+#if CONFIG_DIFFTEST_BISECT > 0
+  static uint64_t next_snapshot = 0;
+  // REF is one instruction behind here, and the resumed copy goes on from this point
+  if (nr_pending == 0 && bisect_end == 0 && nr_inst >= next_snapshot) {
+    next_snapshot = nr_inst + CONFIG_DIFFTEST_BISECT;
+    uint64_t target = 0;
+    if (snapshot_take_diff(&target)) bisect_end = target;
+  }
+#endif
+  nr_inst ++;
+  nr_pending ++;
+  // also check the last window when DUT stops, e.g. at the end of the program
+  if (nr_pending >= (bisect_end != 0 ? 1 : CONFIG_DIFFTEST_BATCH) ||
+      nemu_state.state != NEMU_RUNNING) check_window(pc);
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST_PIPELINE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/* DUT pushes what each instruction commits into a single-producer
+ * single-consumer ring: the registers it changes, its stores to pmem and
+ * its pc. REF is driven by a thread of its own, which rebuilds a shadow
+ * copy of the DUT registers from the records and compares REF with it
+ * after each instruction, so both models run at the same time. DUT sees
+ * a divergence at its next instruction, at most a ring of records after
+ * the diverging one.
+ */
+#define RING_SIZE 4096
+#define NR_DIFF_REG (DIFFTEST_REG_SIZE / sizeof(word_t)) // the last one is pc
+#define MAX_STORE 16 // stores checked per instruction
+#define TAIL_BATCH 256 // records consumed before REF publishes its progress
+
+enum { REC_REG, REC_STORE, REC_STEP, REC_SKIP };
+
+// an instruction changing a single register takes only a REC_STEP record
+typedef struct {
+  uint8_t type;
+  uint8_t len;   // of a store
+  uint16_t idx;  // of the register changed, or pc for none
+  word_t data;   // the register changed, or the data stored
+  paddr_t addr;  // of a store
+  vaddr_t pc, npc;
+} DiffRecord;
+
+static DiffRecord diff_ring[RING_SIZE];
+static _Alignas(64) atomic_uint_fast64_t ring_head = 0; // moved by DUT
+static _Alignas(64) atomic_uint_fast64_t ring_tail = 0; // moved by the REF thread
+static atomic_bool diverged = false;
+static uint64_t cached_tail = 0;          // the last ring_tail seen by DUT
+static word_t dut_regs[NR_DIFF_REG];      // the DUT registers already pushed
+static word_t shadow[NR_DIFF_REG];        // the DUT registers rebuilt by the REF thread
+
+// written by the REF thread before it sets `diverged`
+static struct {
+  vaddr_t pc;
+  CPU_state ref;
+  word_t dut[NR_DIFF_REG];
+  bool store;
+  paddr_t addr;
+  word_t ref_data, dut_data;
+} diverge_info;
+
+static void push(DiffRecord rec) {
+  uint64_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  if (unlikely(head - cached_tail >= RING_SIZE)) {
+    // wait until a quarter of the ring is free, to hand over the cache lines in bulk
+    while (head - (cached_tail = atomic_load_explicit(&ring_tail, memory_order_acquire)) > RING_SIZE * 3 / 4) {
+      if (atomic_load(&diverged)) return; // the REF thread has stopped
+      sched_yield();
+    }
+  }
+  diff_ring[head % RING_SIZE] = rec;
+  atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+}
+
+// in the REF thread, run REF for the instruction at `pc` and compare
+static bool ref_step(vaddr_t pc, DiffRecord *store, int nr_store) {
+  CPU_state ref_r;
+  ref_difftest_exec(1);
+  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+  bool ok = memcmp(&ref_r, shadow, DIFFTEST_REG_SIZE) == 0;
+  diverge_info.store = false;
+  for (int i = 0; i < nr_store && ok; i ++) {
+    word_t data = 0, mask = (store[i].len < sizeof(word_t) ? (1ull << (store[i].len * 8)) - 1 : -1);
+    ref_difftest_memcpy(store[i].addr, &data, store[i].len, DIFFTEST_TO_DUT);
+    if ((data & mask) == (store[i].data & mask)) continue;
+    ok = false;
+    diverge_info = (typeof(diverge_info)){ .store = true, .addr = store[i].addr,
+      .ref_data = data & mask, .dut_data = store[i].data & mask };
+  }
+  if (!ok) {
+    diverge_info.pc = pc;
+    diverge_info.ref = ref_r;
+    memcpy(diverge_info.dut, shadow, DIFFTEST_REG_SIZE);
+  }
+  return ok;
+}
+
+static void* ref_thread(void *arg) {
+  uint64_t tail = atomic_load(&ring_tail), head = tail;
+  DiffRecord store[MAX_STORE];
+  int nr_store = 0, idle = 0;
+  while (true) {
+    if (tail == head) {
+      head = atomic_load_explicit(&ring_head, memory_order_acquire);
+      if (tail == head) {
+        atomic_store_explicit(&ring_tail, tail, memory_order_release);
+        // sleep longer and longer if DUT is stopped, e.g. in sdb
+        if (++ idle < 64) sched_yield();
+        else usleep(idle < 1024 ? 100 : 10000);
+        continue;
+      }
+      idle = 0;
+    }
+    DiffRecord *r = &diff_ring[tail % RING_SIZE];
+    switch (r->type) {
+      case REC_REG: shadow[r->idx] = r->data; break;
+      case REC_STORE: if (nr_store < MAX_STORE) store[nr_store ++] = *r; break;
+      case REC_SKIP:
+        shadow[r->idx] = r->data;
+        shadow[NR_DIFF_REG - 1] = r->npc;
+        ref_difftest_regcpy(shadow, DIFFTEST_TO_REF);
+        nr_store = 0;
+        break;
+      case REC_STEP:
+        shadow[r->idx] = r->data;
+        shadow[NR_DIFF_REG - 1] = r->npc;
+        if (!ref_step(r->pc, store, nr_store)) {
+          // publish diverge_info along with the flag
+          atomic_store_explicit(&diverged, true, memory_order_release);
+          return NULL;
+        }
+        nr_store = 0;
+        break;
+    }
+    tail ++;
+    if (tail % TAIL_BATCH == 0) atomic_store_explicit(&ring_tail, tail, memory_order_release);
+  }
+  return NULL;
+}
+
+static void start_ref_thread() {
+  pthread_t tid;
+  Assert(pthread_create(&tid, NULL, ref_thread, NULL) == 0, "fail to create the thread for REF");
+  pthread_detach(tid);
+}
+
+// wait until REF catches up with DUT
+static void pipe_drain() {
+  while (atomic_load(&ring_tail) != atomic_load(&ring_head) && !atomic_load(&diverged)) sched_yield();
+}
+
+static void init_pipe() {
+  memcpy(dut_regs, &cpu, DIFFTEST_REG_SIZE);
+  memcpy(shadow, &cpu, DIFFTEST_REG_SIZE);
+  start_ref_thread();
+  // only the calling thread survives fork(), so start another REF thread in the child
+  pthread_atfork(pipe_drain, NULL, start_ref_thread);
+  Log("REF runs on its own thread, and DUT may be up to %d records ahead of it", RING_SIZE);
+}
+
+static void pipe_report() {
+  static bool reported = false;
+  if (reported) return;
+  reported = true;
+  // go back to the registers right after the diverging instruction,
+  // while the memory may have been changed by the following ones
+  memcpy(&cpu, diverge_info.dut, DIFFTEST_REG_SIZE);
+  Log("Diverge at pc = " FMT_WORD ", the registers of DUT are restored to this point",
+      diverge_info.pc);
+  if (diverge_info.store) {
+    Log("Store to " FMT_PADDR " is different, right = " FMT_WORD ", wrong = " FMT_WORD,
+        diverge_info.addr, diverge_info.ref_data, diverge_info.dut_data);
+  }
+  isa_difftest_checkregs(&diverge_info.ref, diverge_info.pc);
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = diverge_info.pc;
+  isa_reg_display();
+}
+
+// called by vaddr_write_slow() for every store to pmem
+void difftest_store(paddr_t addr, int len, word_t data) {
+  push((DiffRecord){ .type = REC_STORE, .len = len, .addr = addr, .data = data });
+}
+
+static void pipe_step(vaddr_t pc, vaddr_t npc, bool skip) {
+  DiffRecord rec = { .type = (skip ? REC_SKIP : REC_STEP), .idx = NR_DIFF_REG - 1,
+    .data = npc, .pc = pc, .npc = npc };
+  word_t *regs = (word_t *)&cpu;
+  for (int i = 0; i < NR_DIFF_REG - 1; i ++) {
+    if (regs[i] == dut_regs[i]) continue;
+    dut_regs[i] = regs[i];
+    if (rec.idx == NR_DIFF_REG - 1) { rec.idx = i; rec.data = regs[i]; }
+    else push((DiffRecord){ .type = REC_REG, .idx = i, .data = regs[i] });
+  }
+  push(rec);
+  if (unlikely(atomic_load_explicit(&diverged, memory_order_acquire))) pipe_report();
+}
+#endif
+
+// called when DUT stops running, wait for the result of the last instructions
+void difftest_sync() {
+#ifdef CONFIG_DIFFTEST_PIPELINE
+  pipe_drain();
+  if (atomic_load_explicit(&diverged, memory_order_acquire)) pipe_report();
+#endif
+#if CONFIG_DIFFTEST_BATCH > 1
+  // e.g. after `si`, which stops in the middle of a window
+  if (nr_pending > 0) check_window(cpu.pc);
+#endif
+}
+
+// copy the whole state of DUT to REF, after it is replaced by a checkpoint
+void difftest_reload() {
+  if (ref_difftest_memcpy == NULL) return; // REF is not loaded yet
+  difftest_sync();
+  // untouched pages are still waiting for the random filling, leave them to REF
+  for (size_t i = 0; i < CONFIG_MSIZE; i += PAGE_SIZE) {
+    if (pmem_touched(CONFIG_MBASE + i)) {
+      ref_difftest_memcpy(CONFIG_MBASE + i, guest_to_host(CONFIG_MBASE + i), PAGE_SIZE, DIFFTEST_TO_REF);
+    }
+  }
+  ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+#ifdef CONFIG_DIFFTEST_PIPELINE
+  // the REF thread is waiting for new records after difftest_sync()
+  memcpy(dut_regs, &cpu, DIFFTEST_REG_SIZE);
+  memcpy(shadow, &cpu, DIFFTEST_REG_SIZE);
+#endif
+}
+
 // this is used to let ref skip instructions which
 // can not produce consistent behavior with NEMU
 void difftest_skip_ref() {
@@ -43,6 +313,10 @@ void difftest_skip_ref() {
   // will load that memory, we will encounter false negative. But such
   // situation is infrequent.
   skip_dut_nr_inst = 0;
+#if CONFIG_DIFFTEST_BATCH > 1
+  // this is called before the instruction writes back, so end the window here
+  if (nr_pending > 0) check_window(cpu.pc);
+#endif
 }
 
 // this is used to deal with instruction packing in QEMU.
@@ -52,6 +326,10 @@ void difftest_skip_ref() {
 //   Let REF run `nr_ref` instructions first.
 //   We expect that DUT will catch up with REF within `nr_dut` instructions.
 void difftest_skip_dut(int nr_ref, int nr_dut) {
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, panic("difftest_skip_dut() is not supported by the pipelined difftest"));
+#if CONFIG_DIFFTEST_BATCH > 1
+  if (nr_pending > 0) check_window(cpu.pc);
+#endif
   skip_dut_nr_inst += nr_dut;
 
   while (nr_ref -- > 0) {
@@ -85,10 +363,14 @@ void init_difftest(char *ref_so_file, long img_size, int port) {
   Log("The result of every instruction will be compared with %s. "
       "This will help you a lot for debugging, but also significantly reduce the performance. "
       "If it is not necessary, you can turn it off in menuconfig.", ref_so_file);
+#if CONFIG_DIFFTEST_BATCH > 1
+  Log("The registers are compared every %d instructions", CONFIG_DIFFTEST_BATCH);
+#endif
 
   ref_difftest_init(port);
   ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF);
   ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, init_pipe());
 }
 
 static void checkregs(CPU_state *ref, vaddr_t pc) {
@@ -100,6 +382,11 @@ static void checkregs(CPU_state *ref, vaddr_t pc) {
 }
 
 void difftest_step(vaddr_t pc, vaddr_t npc) {
+#ifdef CONFIG_DIFFTEST_PIPELINE
+  pipe_step(pc, npc, is_skip_ref);
+  is_skip_ref = false;
+  return;
+#endif
   CPU_state ref_r;
 
   if (skip_dut_nr_inst > 0) {
@@ -122,10 +409,14 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
     return;
   }
 
+#if CONFIG_DIFFTEST_BATCH > 1
+  batch_step(pc);
+#else
   ref_difftest_exec(1);
   ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
 
   checkregs(&ref_r, pc);
+#endif
 }
 #else
 void init_difftest(char *ref_so_file, long img_size, int port) { }
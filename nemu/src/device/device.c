@@ -15,7 +15,7 @@
 
 #include <common.h>
 #include <utils.h>
-#include <device/alarm.h>
+#include <device/event.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
 #endif
@@ -28,12 +28,16 @@ void init_i8042();
 void init_audio();
 void init_disk();
 void init_sdcard();
-void init_alarm();
 
 void send_key(uint8_t, bool);
 void vga_update_screen();
 
-void device_update() {
+// The screen and the SDL events face the host, so they are updated
+// TIMER_HZ times per second of wall time like the RTC, while the wall
+// clock is checked HOST_POLL_HZ times per second of virtual time.
+#define HOST_POLL_HZ 10000
+
+static void device_update() {
   static uint64_t last = 0;
   uint64_t now = get_time();
   if (now - last < 1000000 / TIMER_HZ) {
@@ -85,5 +89,5 @@ void init_device() {
   IFDEF(CONFIG_HAS_DISK, init_disk());
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
 
-  IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  add_event(device_update, EVENT_PERIOD(HOST_POLL_HZ), EVENT_PERIOD(HOST_POLL_HZ));
 }
@@ -0,0 +1,99 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/event.h>
+
+/* A min-heap of events ordered by their deadlines in guest instructions.
+ * The execution loop only compares the instruction counter with
+ * `g_event_deadline`, and calls event_run() when it is reached.
+ */
+#define MAX_EVENT 16
+
+typedef struct {
+  uint64_t deadline;
+  uint64_t start; // the first deadline
+  uint64_t period;
+  event_handler_t handler;
+} Event;
+
+static Event heap[MAX_EVENT] = {};
+static int nr_event = 0;
+uint64_t g_event_deadline = UINT64_MAX;
+
+extern uint64_t g_nr_guest_inst;
+
+static void heap_push(Event e) {
+  assert(nr_event < MAX_EVENT);
+  int i = nr_event ++;
+  while (i > 0 && heap[(i - 1) / 2].deadline > e.deadline) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = e;
+}
+
+static Event heap_pop() {
+  Event top = heap[0];
+  Event last = heap[-- nr_event];
+  int i = 0;
+  while (true) {
+    int c = 2 * i + 1;
+    if (c >= nr_event) break;
+    if (c + 1 < nr_event && heap[c + 1].deadline < heap[c].deadline) c ++;
+    if (heap[c].deadline >= last.deadline) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  if (nr_event > 0) heap[i] = last;
+  return top;
+}
+
+void add_event(event_handler_t h, uint64_t delay, uint64_t period) {
+  uint64_t start = g_nr_guest_inst + delay;
+  heap_push((Event){ .deadline = start, .start = start, .period = period, .handler = h });
+  g_event_deadline = heap[0].deadline;
+}
+
+// fire all events whose deadlines are not later than `now`
+void event_run(uint64_t now) {
+  while (nr_event > 0 && heap[0].deadline <= now) {
+    Event e = heap_pop();
+    e.handler();
+    if (e.period != 0) {
+      e.deadline += e.period;
+      heap_push(e);
+    }
+  }
+  g_event_deadline = (nr_event > 0 ? heap[0].deadline : UINT64_MAX);
+}
+
+// Reschedule the events after the instruction counter is restored to
+// `now` from a checkpoint. A periodic event gets its next deadline in its
+// original phase, so the events fire at the same points as in the run
+// which saved the checkpoint.
+void event_reload(uint64_t now) {
+  Event e[MAX_EVENT];
+  int n = nr_event;
+  memcpy(e, heap, sizeof(e[0]) * n);
+  nr_event = 0;
+  for (int i = 0; i < n; i ++) {
+    e[i].deadline = e[i].start;
+    if (e[i].period != 0 && now > e[i].start) {
+      e[i].deadline += (now - e[i].start + e[i].period - 1) / e[i].period * e[i].period;
+    }
+    heap_push(e[i]);
+  }
+  g_event_deadline = (nr_event > 0 ? heap[0].deadline : UINT64_MAX);
+}
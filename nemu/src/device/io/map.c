@@ -17,6 +17,7 @@
 #include <memory/host.h>
 #include <memory/vaddr.h>
 #include <device/map.h>
+#include <utils.h>
 
 #define IO_SPACE_MAX (32 * 1024 * 1024)
 
@@ -29,6 +30,7 @@ uint8_t* new_space(int size) {
   size = (size + (PAGE_SIZE - 1)) & ~PAGE_MASK;
   p_space += size;
   assert(p_space - io_space < IO_SPACE_MAX);
+  checkpoint_add("io space", p, size, NULL);
   return p;
 }
 
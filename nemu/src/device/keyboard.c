@@ -49,6 +49,12 @@ static void init_keymap() {
 static int key_queue[KEY_QUEUE_LEN] = {};
 static int key_f = 0, key_r = 0;
 
+static void init_key_queue() {
+  checkpoint_add("key queue", key_queue, sizeof(key_queue), NULL);
+  checkpoint_add("key queue front", &key_f, sizeof(key_f), NULL);
+  checkpoint_add("key queue rear", &key_r, sizeof(key_r), NULL);
+}
+
 static void key_enqueue(uint32_t am_scancode) {
   key_queue[key_r] = am_scancode;
   key_r = (key_r + 1) % KEY_QUEUE_LEN;
@@ -97,4 +103,5 @@ void init_i8042() {
   add_mmio_map("keyboard", CONFIG_I8042_DATA_MMIO, i8042_data_port_base, 4, i8042_data_io_handler);
 #endif
   IFNDEF(CONFIG_TARGET_AM, init_keymap());
+  IFNDEF(CONFIG_TARGET_AM, init_key_queue());
 }
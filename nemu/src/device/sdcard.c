@@ -14,6 +14,7 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <utils.h>
 #include "mmc.h"
 
 // http://www.files.e-shop.co.il/pdastore/Tech-mmc-samsung/SEC%20MMC%20SPEC%20ver09.pdf
@@ -122,6 +123,11 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
   }
 }
 
+// move the image file to the position of the restored transfer
+static void sdcard_post_load() {
+  if (fp) fseek(fp, (blk_addr << 9) + (read_ext_csd ? 0 : addr), SEEK_SET);
+}
+
 void init_sdcard() {
   base = (uint32_t *)new_space(0x80);
   add_mmio_map("sdhci", CONFIG_SDCARD_CTL_MMIO, base, 0x80, sdcard_io_handler);
@@ -131,4 +137,10 @@ void init_sdcard() {
   const char *img = CONFIG_SDCARD_IMG_PATH;
   fp = fopen(img, "r+");
   if (fp == NULL) Log("Can not find sdcard image: %s", img);
+
+  checkpoint_add("sdcard blkcnt", &blkcnt, sizeof(blkcnt), NULL);
+  checkpoint_add("sdcard blk_addr", &blk_addr, sizeof(blk_addr), NULL);
+  checkpoint_add("sdcard addr", &addr, sizeof(addr), NULL);
+  checkpoint_add("sdcard write_cmd", &write_cmd, sizeof(write_cmd), NULL);
+  checkpoint_add("sdcard read_ext_csd", &read_ext_csd, sizeof(read_ext_csd), sdcard_post_load);
 }
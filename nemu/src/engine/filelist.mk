@@ -15,3 +15,12 @@
 
 INC_PATH += $(NEMU_HOME)/src/engine/$(ENGINE)
 DIRS-y += src/engine/$(ENGINE)
+
+ifndef CONFIG_DCACHE
+SRCS-BLACKLIST-y += src/engine/interpreter/dcache.c
+endif
+
+# other engines share the runtime support of the interpreter
+ifneq ($(CONFIG_ENGINE_THREADED)$(CONFIG_ENGINE_JIT),)
+SRCS-y += src/engine/interpreter/init.c src/engine/interpreter/hostcall.c
+endif
@@ -0,0 +1,74 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <cpu/decode.h>
+#include <memory/paddr.h>
+
+/* The decoded instruction cache is direct-mapped and indexed by the guest PC.
+ * It is organized as struct-of-arrays, so that a lookup only touches the
+ * densely packed `dc_pc` column until it hits.
+ */
+#define DCACHE_BITS 12
+#define DCACHE_SIZE (1 << DCACHE_BITS)
+#define DCACHE_INVALID ((vaddr_t)-1)
+
+static vaddr_t dc_pc[DCACHE_SIZE] = { [0 ... DCACHE_SIZE - 1] = DCACHE_INVALID };
+static const void *dc_exec[DCACHE_SIZE] = {};
+static ISADecodeInfo dc_info[DCACHE_SIZE] = {};
+
+static inline int dcache_idx(vaddr_t pc) {
+  return (pc >> 2) & (DCACHE_SIZE - 1);
+}
+
+bool dcache_lookup(Decode *s) {
+  int idx = dcache_idx(s->pc);
+  if (likely(dc_pc[idx] == s->pc)) {
+    s->exec = dc_exec[idx];
+    s->isa = dc_info[idx];
+    return true;
+  }
+  return false;
+}
+
+void dcache_insert(Decode *s) {
+  int idx = dcache_idx(s->pc);
+  dc_pc[idx] = s->pc;
+  dc_exec[idx] = s->exec;
+  dc_info[idx] = s->isa;
+}
+
+// called on guest stores to code pages to drop the stale entries of
+// self-modifying code, the entries are keyed by the PC which is only
+// known to be the physical address if paging is off
+static void dcache_invalidate(paddr_t addr, int len) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_IFETCH) != MMU_DIRECT) { dcache_flush(); return; }
+  vaddr_t pc = addr & ~(vaddr_t)3;
+  int nr_word = ((addr & 3) + len + 3) / 4;
+  for (; nr_word > 0; nr_word --, pc += 4) {
+    int idx = dcache_idx(pc);
+    if (dc_pc[idx] == pc) { dc_pc[idx] = DCACHE_INVALID; }
+  }
+}
+
+void dcache_flush() {
+  for (int i = 0; i < DCACHE_SIZE; i ++) {
+    dc_pc[i] = DCACHE_INVALID;
+  }
+}
+
+void dcache_init() {
+  paddr_add_code_hook(dcache_invalidate);
+}
@@ -14,10 +14,15 @@
 ***************************************************************************************/
 
 #include <cpu/cpu.h>
+#include <cpu/decode.h>
 
 void sdb_mainloop();
 
 void engine_start() {
+  IFDEF(CONFIG_DCACHE, dcache_init());
+  IFDEF(CONFIG_ENGINE_THREADED, tcache_init());
+  IFDEF(CONFIG_ENGINE_JIT, jit_init());
+
 #ifdef CONFIG_TARGET_AM
   cpu_exec(-1);
 #else
@@ -0,0 +1,147 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __JIT_EMIT_H__
+#define __JIT_EMIT_H__
+
+#include <common.h>
+
+// x86-64 instruction encoders used by the JIT, emitting at `jit_cur`
+extern uint8_t *jit_cur;
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// condition codes
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_L = 0xc, CC_GE = 0xd };
+
+// group-1 ALU operations, the `reg` field of opcode 0x81
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+
+// shift operations, the `reg` field of opcode 0xc1/0xd3
+enum { SH_SHL = 4, SH_SHR = 5, SH_SAR = 7 };
+
+static inline void emit8(uint8_t x) { *jit_cur ++ = x; }
+static inline void emit32(uint32_t x) { memcpy(jit_cur, &x, 4); jit_cur += 4; }
+static inline void emit64(uint64_t x) { memcpy(jit_cur, &x, 8); jit_cur += 8; }
+
+static inline void emit_rex(int w, int reg, int rm) {
+  uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+  if (rex != 0x40) emit8(rex);
+}
+
+static inline void emit_modrm(int mod, int reg, int rm) {
+  emit8((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op r32, [rbx + disp32] (0x8b) or op [rbx + disp32], r32 (0x89)
+static inline void emit_op_cpu(uint8_t op, int r, int32_t disp) {
+  emit_rex(0, r, RBX); emit8(op); emit_modrm(2, r, RBX); emit32(disp);
+}
+#define emit_load_cpu(r, disp)  emit_op_cpu(0x8b, r, disp)
+#define emit_store_cpu(r, disp) emit_op_cpu(0x89, r, disp)
+
+// mov dword [rbx + disp32], imm32
+static inline void emit_store_cpu_imm(int32_t disp, uint32_t imm) {
+  emit8(0xc7); emit_modrm(2, 0, RBX); emit32(disp); emit32(imm);
+}
+
+static inline void emit_mov_imm(int r, uint32_t imm) {
+  emit_rex(0, 0, r); emit8(0xb8 + (r & 7)); emit32(imm);
+}
+
+static inline void emit_mov_imm64(int r, uint64_t imm) {
+  emit_rex(1, 0, r); emit8(0xb8 + (r & 7)); emit64(imm);
+}
+
+// op dst, src (32-bit), `op` is the "r/m, reg" form: add 01, or 09,
+// and 21, sub 29, xor 31, cmp 39, mov 89, test 85
+static inline void emit_alu(uint8_t op, int dst, int src) {
+  emit_rex(0, src, dst); emit8(op); emit_modrm(3, src, dst);
+}
+
+static inline void emit_alu_imm(int w, int alu, int dst, uint32_t imm) {
+  emit_rex(w, 0, dst); emit8(0x81); emit_modrm(3, alu, dst); emit32(imm);
+}
+
+static inline void emit_shift_imm(int sh, int dst, uint8_t imm) {
+  emit_rex(0, 0, dst); emit8(0xc1); emit_modrm(3, sh, dst); emit8(imm);
+}
+
+static inline void emit_shift_cl(int sh, int dst) {
+  emit_rex(0, 0, dst); emit8(0xd3); emit_modrm(3, sh, dst);
+}
+
+// setcc r8; movzx r32, r8 (only for eax, ecx, edx and ebx)
+static inline void emit_setcc(int cc, int dst) {
+  emit8(0x0f); emit8(0x90 + cc); emit_modrm(3, 0, dst);
+  emit8(0x0f); emit8(0xb6); emit_modrm(3, dst, dst);
+}
+
+// movsx r32, r8/r16 (only for eax, ecx, edx and ebx)
+static inline void emit_sext(int len, int r) {
+  emit8(0x0f); emit8(len == 1 ? 0xbe : 0xbf); emit_modrm(3, r, r);
+}
+
+// jcc/jmp rel32, return the address of the rel32 field for patching
+static inline uint8_t* emit_jcc(int cc) {
+  emit8(0x0f); emit8(0x80 + cc); uint8_t *p = jit_cur; emit32(0); return p;
+}
+
+static inline uint8_t* emit_jmp() {
+  emit8(0xe9); uint8_t *p = jit_cur; emit32(0); return p;
+}
+
+static inline void patch_rel32(uint8_t *p, const void *target) {
+  int32_t rel = (const uint8_t *)target - (p + 4);
+  memcpy(p, &rel, 4);
+}
+
+static inline void emit_jmp_reg(int r) {
+  emit_rex(0, 0, r); emit8(0xff); emit_modrm(3, 4, r);
+}
+
+static inline void emit_call(const void *fn) {
+  emit_mov_imm64(RAX, (uintptr_t)fn); emit8(0xff); emit_modrm(3, 2, RAX);
+}
+
+static inline void emit_push(int r) { emit_rex(0, 0, r); emit8(0x50 + (r & 7)); }
+static inline void emit_pop(int r)  { emit_rex(0, 0, r); emit8(0x58 + (r & 7)); }
+
+// the memory operand [base + index] with SIB, no displacement
+static inline void emit_sib(int reg, int base, int index) {
+  emit_modrm(0, reg, 4); emit8(((index & 7) << 3) | (base & 7));
+}
+
+// r32 <- [r12 + rax] with zero/sign extension (r should be a legacy register)
+static inline void emit_load_host(int len, bool sign, int r) {
+  emit_rex(0, r, R12);
+  switch (len) {
+    case 4: emit8(0x8b); break;
+    case 2: emit8(0x0f); emit8(sign ? 0xbf : 0xb7); break;
+    case 1: emit8(0x0f); emit8(sign ? 0xbe : 0xb6); break;
+    default: assert(0);
+  }
+  emit_sib(r, R12, RAX);
+}
+
+// [r12 + rax] <- r32/r16/r8 (r should be eax, ecx, edx or ebx)
+static inline void emit_store_host(int len, int r) {
+  if (len == 2) emit8(0x66);
+  emit_rex(0, r, R12);
+  emit8(len == 1 ? 0x88 : 0x89);
+  emit_sib(r, R12, RAX);
+}
+
+#endif
@@ -0,0 +1,424 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "emit.h"
+
+#if !defined(__x86_64__)
+#error "the JIT engine only supports x86-64 hosts"
+#endif
+
+/* Hot guest basic blocks are translated into x86-64 code. While running
+ * translated code, the host registers are used as
+ *   rbx: &cpu   r12: host address of pmem   r13: remaining instruction budget
+ *   r14: pointer to the budget in memory    r15: slow page map
+ * Guest registers live in `cpu.gpr` and are loaded into eax/ecx/esi for
+ * each instruction. Each block checks the budget at its entry and charges
+ * all its instructions at once, so only whole blocks are run.
+ *
+ * A block leaves through its exits. An exit first jumps to a stub which
+ * sets `cpu.pc` and returns to C with the address of the jump, which is
+ * then patched to the target block once the target is translated.
+ *
+ * Stores to the pages with translated code or watched by paddr_watch()
+ * go through jit_store(), which leaves the block if the code cache is
+ * flushed or the machine is stopped, e.g. at a watchpoint.
+ *
+ * A block ends before a pc which may have a breakpoint, and exits to such
+ * a pc are never chained, so that execute() checks the breakpoint when the
+ * JIT returns. The code cache is flushed when the breakpoints change.
+ */
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+#define JIT_BLOCK_CODE_MAX (32 * 1024) // reserved space for translating a block
+#define JIT_BLOCK_MAX 64  // maximum number of instructions in a block
+#define JIT_HOT 16        // translate a block after it is interpreted this many times
+#define JIT_NOT_TRANSLATABLE ((uint32_t)-1)
+
+#define JBLOCK_BITS 14
+#define JBLOCK_SIZE (1 << JBLOCK_BITS)
+
+#define NR_PAGE (CONFIG_MSIZE >> PAGE_SHIFT)
+
+#define GPR(i) ((int32_t)(offsetof(CPU_state, gpr) + (i) * sizeof(word_t)))
+#define PC     ((int32_t)offsetof(CPU_state, pc))
+
+typedef struct {
+  vaddr_t pc;
+  uint32_t count; // times interpreted
+  void *code;
+} JBlock;
+
+typedef uintptr_t (*jit_enter_t)(void *code, uint64_t *budget);
+
+uint8_t *jit_cur = NULL;
+static uint8_t *code_buf = NULL;
+static uint8_t *code_start = NULL; // the first block after the trampoline
+static jit_enter_t jit_enter = NULL;
+static uint8_t *jit_exit = NULL;
+static JBlock jb[JBLOCK_SIZE] = {};
+// pages whose stores take the slow path
+#define PAGE_CODE  1 // holding translated code
+#define PAGE_WATCH 2 // watched, see jit_update_watch()
+static uint8_t code_page[NR_PAGE] = {};
+static bool jit_flushed = false;
+
+static inline JBlock* jblock(vaddr_t pc) {
+  return &jb[(pc >> 2) & (JBLOCK_SIZE - 1)];
+}
+
+void jit_flush() {
+  for (int i = 0; i < JBLOCK_SIZE; i ++) { jb[i].pc = (vaddr_t)-1; }
+  for (int i = 0; i < NR_PAGE; i ++) { code_page[i] &= PAGE_WATCH; }
+  jit_cur = code_start;
+  jit_flushed = true;
+}
+
+// called when the pages watched by paddr_watch() change, the translated
+// code tests the page map at run time, so nothing needs to be flushed
+void jit_update_watch() {
+  for (paddr_t i = 0; i < NR_PAGE; i ++) {
+    code_page[i] &= ~PAGE_WATCH;
+    if (paddr_is_watched(CONFIG_MBASE + (i << PAGE_SHIFT))) code_page[i] |= PAGE_WATCH;
+  }
+}
+
+// --- helpers called by translated code ---
+
+static word_t jit_load(vaddr_t addr, int len) {
+  return vaddr_read(addr, len);
+}
+
+// return whether to leave the block after this store, because the code
+// cache is flushed or the machine is stopped
+static int jit_store(vaddr_t addr, int len, word_t data) {
+  jit_flushed = false;
+  vaddr_write(addr, len, data);
+  return jit_flushed || nemu_state.state != NEMU_RUNNING;
+}
+
+static inline bool is_bp(vaddr_t pc) {
+  return MUXDEF(CONFIG_BREAKPOINT, bp_maybe(pc), false);
+}
+
+static void* jit_lookup(vaddr_t pc) {
+  JBlock *b = jblock(pc);
+  return (b->pc == pc && !is_bp(pc) ? b->code : NULL);
+}
+
+// --- translation ---
+
+static void emit_trampoline() {
+  jit_enter = (jit_enter_t)jit_cur;
+  emit_push(RBX); emit_push(RBP); emit_push(R12);
+  emit_push(R13); emit_push(R14); emit_push(R15);
+  emit_alu_imm(1, ALU_SUB, RSP, 8); // keep the stack aligned for helper calls
+  emit_mov_imm64(RBX, (uintptr_t)&cpu);
+  emit_mov_imm64(R12, (uintptr_t)guest_to_host(CONFIG_MBASE));
+  emit_mov_imm64(R15, (uintptr_t)code_page);
+  emit_rex(1, RSI, R14); emit8(0x89); emit_modrm(3, RSI, R14); // mov r14, rsi
+  emit_rex(1, R13, R14); emit8(0x8b); emit_modrm(0, R13, R14); // mov r13, [r14]
+  emit_jmp_reg(RDI);
+
+  jit_exit = jit_cur;
+  emit_rex(1, R13, R14); emit8(0x89); emit_modrm(0, R13, R14); // mov [r14], r13
+  emit_alu_imm(1, ALU_ADD, RSP, 8);
+  emit_pop(R15); emit_pop(R14); emit_pop(R13);
+  emit_pop(R12); emit_pop(RBP); emit_pop(RBX);
+  emit8(0xc3); // ret
+}
+
+// leave the block to a known target, the jump can be patched for chaining
+static void emit_exit(vaddr_t target) {
+  uint8_t *site = emit_jmp();
+  patch_rel32(site, jit_cur);
+  emit_store_cpu_imm(PC, target);
+  emit_mov_imm64(RAX, (uintptr_t)site);
+  patch_rel32(emit_jmp(), jit_exit);
+}
+
+// leave the block without chaining, `cpu.pc` should have been set
+static void emit_exit_nochain(uint32_t nr_refund) {
+  if (nr_refund > 0) emit_alu_imm(1, ALU_ADD, R13, nr_refund);
+  emit_alu(0x31, RAX, RAX);
+  patch_rel32(emit_jmp(), jit_exit);
+}
+
+// esi <- gpr[rs1] + imm, eax <- esi - MBASE, and jump to the returned
+// rel32 when the access is out of pmem
+static uint8_t* emit_addr(int rs1, word_t imm, int len) {
+  emit_load_cpu(RSI, GPR(rs1));
+  if (imm != 0) emit_alu_imm(0, ALU_ADD, RSI, imm);
+  emit_alu(0x89, RAX, RSI);
+  emit_alu_imm(0, ALU_SUB, RAX, CONFIG_MBASE);
+  emit_alu_imm(0, ALU_CMP, RAX, CONFIG_MSIZE - len);
+  return emit_jcc(CC_A);
+}
+
+static void emit_load(uint32_t i, vaddr_t pc, int rd, int rs1, word_t imm) {
+  int len = 1 << (BITS(i, 13, 12));
+  bool sign = !BITS(i, 14, 14);
+  uint8_t *slow = emit_addr(rs1, imm, len);
+  emit_load_host(len, sign, RCX);
+  uint8_t *done = emit_jmp();
+
+  patch_rel32(slow, jit_cur);
+  emit_store_cpu_imm(PC, pc);
+  emit_alu(0x89, RDI, RSI);
+  emit_mov_imm(RSI, len);
+  emit_call(jit_load);
+  emit_alu(0x89, RCX, RAX);
+  if (sign && len < 4) emit_sext(len, RCX);
+
+  patch_rel32(done, jit_cur);
+  if (rd != 0) emit_store_cpu(RCX, GPR(rd));
+}
+
+static void emit_store(uint32_t i, vaddr_t pc, int rs1, int rs2, word_t imm, uint32_t nr_left) {
+  int len = 1 << (BITS(i, 13, 12));
+  emit_load_cpu(RCX, GPR(rs2));
+  uint8_t *slow[3];
+  slow[0] = emit_addr(rs1, imm, len);
+  // stores to pages with translated code are handled by the helper
+  emit_alu(0x89, RDX, RAX);
+  emit_shift_imm(SH_SHR, RDX, PAGE_SHIFT);
+  emit_rex(0, 0, R15); emit8(0x80); emit_sib(7, R15, RDX); emit8(0); // cmp byte [r15 + rdx], 0
+  slow[1] = emit_jcc(CC_NE);
+  slow[2] = NULL;
+  if (len > 1) {
+    emit8(0x8d); emit_modrm(1, RDX, RAX); emit8(len - 1); // lea edx, [rax + len - 1]
+    emit_shift_imm(SH_SHR, RDX, PAGE_SHIFT);
+    emit_rex(0, 0, R15); emit8(0x80); emit_sib(7, R15, RDX); emit8(0);
+    slow[2] = emit_jcc(CC_NE);
+  }
+  emit_store_host(len, RCX);
+  uint8_t *done = emit_jmp();
+
+  for (int k = 0; k < 3; k ++) { if (slow[k]) patch_rel32(slow[k], jit_cur); }
+  emit_store_cpu_imm(PC, pc);
+  emit_alu(0x89, RDI, RSI);
+  emit_mov_imm(RSI, len);
+  emit_alu(0x89, RDX, RCX);
+  emit_call(jit_store);
+  emit_alu(0x85, RAX, RAX);
+  uint8_t *stay = emit_jcc(CC_E);
+  // the code cache is gone or the machine is stopped, leave right now
+  emit_store_cpu_imm(PC, pc + 4);
+  emit_exit_nochain(nr_left);
+  patch_rel32(stay, jit_cur);
+
+  patch_rel32(done, jit_cur);
+}
+
+static word_t immI(uint32_t i) { return SEXT(BITS(i, 31, 20), 12); }
+static word_t immU(uint32_t i) { return SEXT(BITS(i, 31, 12), 20) << 12; }
+static word_t immS(uint32_t i) { return (SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7); }
+static word_t immB(uint32_t i) {
+  return (SEXT(BITS(i, 31, 31), 1) << 12) | (BITS(i, 7, 7) << 11) |
+    (BITS(i, 30, 25) << 5) | (BITS(i, 11, 8) << 1);
+}
+static word_t immJ(uint32_t i) {
+  return (SEXT(BITS(i, 31, 31), 1) << 20) | (BITS(i, 19, 12) << 12) |
+    (BITS(i, 20, 20) << 11) | (BITS(i, 30, 21) << 1);
+}
+
+// Return whether the instruction can be translated, and set `*end`
+// if it ends a block. Only the RV32I base integer instructions except
+// fence and system instructions are supported.
+static bool jit_check(uint32_t i, bool *end) {
+  uint32_t funct3 = BITS(i, 14, 12), funct7 = BITS(i, 31, 25);
+  *end = false;
+  switch (BITS(i, 6, 0)) {
+    case 0x37: case 0x17: return true;               // lui, auipc
+    case 0x6f: *end = true; return true;             // jal
+    case 0x67: *end = true; return funct3 == 0;      // jalr
+    case 0x63: *end = true; return funct3 != 2 && funct3 != 3; // branch
+    case 0x03: return funct3 != 3 && funct3 < 6;     // load
+    case 0x23: return funct3 < 3;                    // store
+    case 0x13:                                       // op-imm
+      if (funct3 == 1) return funct7 == 0;
+      if (funct3 == 5) return funct7 == 0 || funct7 == 0x20;
+      return true;
+    case 0x33:                                       // op
+      return funct7 == 0 || (funct7 == 0x20 && (funct3 == 0 || funct3 == 5));
+    default: return false;
+  }
+}
+
+static void jit_translate_inst(uint32_t i, vaddr_t pc, uint32_t nr_left) {
+  int rd = BITS(i, 11, 7), rs1 = BITS(i, 19, 15), rs2 = BITS(i, 24, 20);
+  uint32_t funct3 = BITS(i, 14, 12), funct7 = BITS(i, 31, 25);
+  switch (BITS(i, 6, 0)) {
+    case 0x37: if (rd) emit_store_cpu_imm(GPR(rd), immU(i)); break;
+    case 0x17: if (rd) emit_store_cpu_imm(GPR(rd), pc + immU(i)); break;
+    case 0x6f:
+      if (rd) emit_store_cpu_imm(GPR(rd), pc + 4);
+      emit_exit(pc + immJ(i));
+      break;
+    case 0x67: {
+      emit_load_cpu(RAX, GPR(rs1));
+      emit_alu_imm(0, ALU_ADD, RAX, immI(i));
+      emit_alu_imm(0, ALU_AND, RAX, ~1u);
+      emit_store_cpu(RAX, PC);
+      if (rd) emit_store_cpu_imm(GPR(rd), pc + 4);
+      // jump to the target directly if it is translated
+      emit_alu(0x89, RDI, RAX);
+      emit_call(jit_lookup);
+      emit_alu(0x85, RAX, RAX);
+      uint8_t *miss = emit_jcc(CC_E);
+      emit_jmp_reg(RAX);
+      patch_rel32(miss, jit_cur);
+      emit_exit_nochain(0);
+      break;
+    }
+    case 0x63: {
+      static const int cc[8] = { CC_E, CC_NE, 0, 0, CC_L, CC_GE, CC_B, CC_AE };
+      emit_load_cpu(RAX, GPR(rs1));
+      emit_load_cpu(RCX, GPR(rs2));
+      emit_alu(0x39, RAX, RCX);
+      uint8_t *not_taken = emit_jcc(cc[funct3] ^ 1);
+      emit_exit(pc + immB(i));
+      patch_rel32(not_taken, jit_cur);
+      emit_exit(pc + 4);
+      break;
+    }
+    case 0x03: emit_load(i, pc, rd, rs1, immI(i)); break;
+    case 0x23: emit_store(i, pc, rs1, rs2, immS(i), nr_left); break;
+    case 0x13: {
+      word_t imm = immI(i);
+      emit_load_cpu(RAX, GPR(rs1));
+      switch (funct3) {
+        case 0: emit_alu_imm(0, ALU_ADD, RAX, imm); break;
+        case 2: emit_alu_imm(0, ALU_CMP, RAX, imm); emit_setcc(CC_L, RAX); break;
+        case 3: emit_alu_imm(0, ALU_CMP, RAX, imm); emit_setcc(CC_B, RAX); break;
+        case 4: emit_alu_imm(0, ALU_XOR, RAX, imm); break;
+        case 6: emit_alu_imm(0, ALU_OR,  RAX, imm); break;
+        case 7: emit_alu_imm(0, ALU_AND, RAX, imm); break;
+        case 1: emit_shift_imm(SH_SHL, RAX, rs2); break;
+        case 5: emit_shift_imm(funct7 ? SH_SAR : SH_SHR, RAX, rs2); break;
+      }
+      if (rd) emit_store_cpu(RAX, GPR(rd));
+      break;
+    }
+    case 0x33:
+      emit_load_cpu(RAX, GPR(rs1));
+      emit_load_cpu(RCX, GPR(rs2));
+      switch (funct3) {
+        case 0: emit_alu(funct7 ? 0x29 : 0x01, RAX, RCX); break;
+        case 1: emit_shift_cl(SH_SHL, RAX); break;
+        case 2: emit_alu(0x39, RAX, RCX); emit_setcc(CC_L, RAX); break;
+        case 3: emit_alu(0x39, RAX, RCX); emit_setcc(CC_B, RAX); break;
+        case 4: emit_alu(0x31, RAX, RCX); break;
+        case 5: emit_shift_cl(funct7 ? SH_SAR : SH_SHR, RAX); break;
+        case 6: emit_alu(0x09, RAX, RCX); break;
+        case 7: emit_alu(0x21, RAX, RCX); break;
+      }
+      if (rd) emit_store_cpu(RAX, GPR(rd));
+      break;
+    default: assert(0);
+  }
+}
+
+// translate the block at `pc`, return NULL if its first instruction is not supported
+static void* jit_translate(vaddr_t pc) {
+  if (!in_pmem(pc) || (pc & 3) != 0) return NULL;
+
+  uint32_t inst[JIT_BLOCK_MAX];
+  int n = 0;
+  bool end = false;
+  vaddr_t p = pc;
+  do {
+    uint32_t i = vaddr_ifetch(p, 4);
+    if (!jit_check(i, &end)) break;
+    inst[n ++] = i;
+    p += 4;
+  } while (!end && n < JIT_BLOCK_MAX && (p & PAGE_MASK) != 0 && !is_bp(p));
+  if (n == 0) return NULL;
+
+  if (jit_cur + JIT_BLOCK_CODE_MAX > code_buf + JIT_CODE_SIZE) { jit_flush(); }
+
+  void *code = jit_cur;
+  emit_alu_imm(1, ALU_CMP, R13, n);
+  uint8_t *bail = emit_jcc(CC_B);
+  emit_alu_imm(1, ALU_SUB, R13, n);
+  for (int k = 0; k < n; k ++) {
+    jit_translate_inst(inst[k], pc + 4 * k, n - k - 1);
+  }
+  if (!end) emit_exit(p);
+
+  // not enough budget for the whole block
+  patch_rel32(bail, jit_cur);
+  emit_store_cpu_imm(PC, pc);
+  emit_exit_nochain(0);
+
+  code_page[(pc - CONFIG_MBASE) >> PAGE_SHIFT] |= PAGE_CODE;
+  return code;
+}
+
+// called on guest stores to code pages, drop all translated code if a
+// page with translated code is written
+static void jit_invalidate(paddr_t addr, int len) {
+  paddr_t off = addr - CONFIG_MBASE;
+  if (off >= CONFIG_MSIZE) return;
+  paddr_t off_end = off + len - 1;
+  if ((code_page[off >> PAGE_SHIFT] & PAGE_CODE) ||
+      (off_end < CONFIG_MSIZE && (code_page[off_end >> PAGE_SHIFT] & PAGE_CODE))) {
+    jit_flush();
+  }
+}
+
+void jit_init() {
+  code_buf = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Assert(code_buf != MAP_FAILED, "fail to allocate the code cache of the JIT");
+  jit_cur = code_buf;
+  emit_trampoline();
+  code_start = jit_cur;
+  jit_flush();
+  paddr_add_code_hook(jit_invalidate);
+}
+
+// Run translated code from cpu.pc for at most `n` instructions, and return
+// the number of instructions executed. Return 0 if the code at cpu.pc
+// should be interpreted.
+uint64_t jit_exec(uint64_t n) {
+  // translated code accesses pmem directly, so it only runs without paging
+  if (isa_mmu_check(cpu.pc, 4, MEM_TYPE_IFETCH) != MMU_DIRECT) return 0;
+
+  vaddr_t pc = cpu.pc;
+  JBlock *b = jblock(pc);
+  if (b->pc != pc) { b->pc = pc; b->count = 0; b->code = NULL; }
+  if (b->code == NULL) {
+    if (b->count == JIT_NOT_TRANSLATABLE || ++ b->count < JIT_HOT) return 0;
+    void *code = jit_translate(pc);
+    b = jblock(pc); // the cache may be flushed
+    b->pc = pc;
+    b->code = code;
+    if (code == NULL) { b->count = JIT_NOT_TRANSLATABLE; return 0; }
+  }
+
+  uint64_t left = n;
+  uint8_t *site = (uint8_t *)jit_enter(b->code, &left);
+  if (site != NULL) {
+    // chain the exit to its target if the target is translated
+    void *target = jit_lookup(cpu.pc);
+    if (target != NULL) patch_rel32(site, target);
+  }
+  return n - left;
+}
@@ -0,0 +1,130 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/vaddr.h>
+#include <memory/paddr.h>
+
+/* Each translated block is an array of decoded instructions starting at
+ * `pc`. The block ends at an instruction which is sure to leave the
+ * sequential path (decided by the ISA), at a page boundary, before a pc
+ * which may have a breakpoint, or when it is full. The cache is
+ * direct-mapped and indexed by the guest PC.
+ */
+#define TCACHE_BITS 10
+#define TCACHE_SIZE (1 << TCACHE_BITS)
+#define TCACHE_INVALID ((vaddr_t)-1)
+#define TBLOCK_MAX 32
+
+// number of cached blocks in each (hashed) guest page, used to filter stores
+#define TPAGE_BITS 12
+#define TPAGE_SIZE (1 << TPAGE_BITS)
+
+typedef struct {
+  vaddr_t pc, end;
+  int n;
+  Decode inst[TBLOCK_MAX];
+} TBlock;
+
+static TBlock tc[TCACHE_SIZE] = { [0 ... TCACHE_SIZE - 1] = { .pc = TCACHE_INVALID } };
+static uint16_t tpage_cnt[TPAGE_SIZE] = {};
+static TBlock *running = NULL; // the block being executed
+
+static inline int tcache_idx(vaddr_t pc) {
+  return (pc >> 2) & (TCACHE_SIZE - 1);
+}
+
+static inline int tpage_idx(vaddr_t pc) {
+  return (pc >> PAGE_SHIFT) & (TPAGE_SIZE - 1);
+}
+
+static void tblock_drop(TBlock *b) {
+  if (b->pc == TCACHE_INVALID) return;
+  tpage_cnt[tpage_idx(b->pc)] --;
+  b->pc = TCACHE_INVALID;
+}
+
+static TBlock* tblock_translate(vaddr_t pc) {
+  TBlock *b = &tc[tcache_idx(pc)];
+  tblock_drop(b);
+  int i = 0;
+  do {
+    Decode *s = &b->inst[i ++];
+    s->pc = pc;
+    bool end = isa_decode_once(s);
+    pc = s->snpc;
+    if (end) break;
+  } while (i < TBLOCK_MAX && (pc & PAGE_MASK) != 0 &&
+      !MUXDEF(CONFIG_BREAKPOINT, bp_maybe(pc), false));
+  b->pc = b->inst[0].pc;
+  b->end = pc;
+  b->n = i;
+  tpage_cnt[tpage_idx(b->pc)] ++;
+  return b;
+}
+
+// Run at most `n` instructions from the block at cpu.pc, and return the
+// number of instructions executed. `last` is set to the last one of them.
+uint64_t tcache_exec(uint64_t n, Decode **last) {
+  vaddr_t pc = cpu.pc;
+  TBlock *b = &tc[tcache_idx(pc)];
+  if (unlikely(b->pc != pc)) { b = tblock_translate(pc); }
+  running = b;
+  int nr = isa_exec_block(b->inst, (n < b->n ? n : b->n));
+  running = NULL;
+  *last = &b->inst[nr - 1];
+  cpu.pc = (*last)->dnpc;
+  return nr;
+}
+
+static void tblock_stop(TBlock *b) {
+  for (int i = 0; i < b->n; i ++) { b->inst[i].snpc = TCACHE_INVALID; }
+}
+
+// Called on guest stores to code pages to drop the blocks covering the
+// written bytes. If the block being executed is dropped, it stops after
+// the store: the poisoned `snpc` breaks the `dnpc == snpc` test which
+// chains to the next instruction, so the modified code is decoded again.
+// Blocks are keyed by the PC, so all of them are dropped with paging on.
+static void tcache_invalidate(paddr_t addr, int len) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_IFETCH) != MMU_DIRECT) {
+    if (running != NULL) tblock_stop(running);
+    tcache_flush();
+    return;
+  }
+  if (likely(tpage_cnt[tpage_idx(addr)] == 0 &&
+        tpage_cnt[tpage_idx(addr + len - 1)] == 0)) return;
+  // only blocks starting at most TBLOCK_MAX words before `addr` can cover it
+  vaddr_t pc = (addr & ~(vaddr_t)3) - 4 * (TBLOCK_MAX - 1);
+  int nr_word = TBLOCK_MAX - 1 + ((addr & 3) + len + 3) / 4;
+  for (; nr_word > 0; nr_word --, pc += 4) {
+    TBlock *b = &tc[tcache_idx(pc)];
+    if (b->pc == pc && addr < b->end && addr + len > pc) {
+      if (b == running) tblock_stop(b);
+      tblock_drop(b);
+    }
+  }
+}
+
+void tcache_flush() {
+  for (int i = 0; i < TCACHE_SIZE; i ++) {
+    tblock_drop(&tc[i]);
+  }
+}
+
+void tcache_init() {
+  paddr_add_code_hook(tcache_invalidate);
+}
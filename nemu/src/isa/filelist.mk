@@ -15,3 +15,22 @@
 
 INC_PATH += $(NEMU_HOME)/src/isa/$(GUEST_ISA)/include
 DIRS-y += src/isa/$(GUEST_ISA)
+
+ifdef CONFIG_DECODE_TREE
+GEN_DECODE_PATH = $(NEMU_HOME)/tools/gen-decode
+GEN_DECODE      = $(GEN_DECODE_PATH)/build/gen-decode
+DECODE_TREE_SRC = src/isa/$(GUEST_ISA)/inst.c
+DECODE_TREE_DIR = $(NEMU_HOME)/build/gen/$(GUEST_ISA)
+DECODE_TREE     = $(DECODE_TREE_DIR)/isa-decode-tree.h
+INC_PATH       += $(DECODE_TREE_DIR)
+GEN_HEADERS    += $(DECODE_TREE)
+
+$(GEN_DECODE): $(GEN_DECODE_PATH)/gen-decode.c
+	@$(MAKE) -s -C $(GEN_DECODE_PATH)
+
+$(DECODE_TREE): $(DECODE_TREE_SRC) $(GEN_DECODE)
+	@echo + GEN $@
+	@mkdir -p $(dir $@)
+	@$(GEN_DECODE) $< > $@.tmp
+	@mv $@.tmp $@
+endif
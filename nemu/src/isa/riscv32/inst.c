@@ -14,6 +14,7 @@
 ***************************************************************************************/
 
 #include "local-include/reg.h"
+#include "local-include/csr.h"
 #include <cpu/cpu.h>
 #include <cpu/ifetch.h>
 #include <cpu/decode.h>
@@ -21,14 +22,22 @@
 #define R(i) gpr(i)
 #define Mr vaddr_read
 #define Mw vaddr_write
+#define CSR(imm) BITS(imm, 11, 0)
+
+// csrrw/csrrs/csrrc: the CSR is not written if rs1 is $0 for csrrs/csrrc
+#define CSRRX(rd, imm, val, write) do { \
+  word_t t = csr_read(CSR(imm)); \
+  if (write) csr_write(CSR(imm), val); \
+  R(rd) = t; \
+} while (0)
 
 enum {
   TYPE_I, TYPE_U, TYPE_S,TYPE_J, TYPE_B, TYPE_R,
   TYPE_N, // none
 };
 
-#define src1R() do { *src1 = R(rs1); } while (0)
-#define src2R() do { *src2 = R(rs2); } while (0)
+#define src1R() do { s->isa.rs1 = rs1; } while (0)
+#define src2R() do { s->isa.rs2 = rs2; } while (0)
 #define immI() do { *imm = SEXT(BITS(i, 31, 20), 12); } while(0)
 #define immU() do { *imm = SEXT(BITS(i, 31, 12), 20) << 12; } while(0)
 #define immS() do { *imm = (SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7); } while(0)
@@ -39,11 +48,17 @@ enum {
   ((SEXT(BITS(i, 7, 7), 1) << 63) >> 63) << 10 | ((SEXT(BITS(i, 30, 25), 6) << 58) >> 58) << 4 | \
    ((SEXT(BITS(i, 11, 8), 4) << 60) >> 60); *imm = *imm << 1; } while (0)
 
-static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_t *imm, int type) {
+// Only the register indices are recorded here. The register values are
+// read right before execution, since the decoding result may be cached.
+static void decode_operand(Decode *s, int type) {
   uint32_t i = s->isa.inst;
   int rs1 = BITS(i, 19, 15);
   int rs2 = BITS(i, 24, 20);
-  *rd     = BITS(i, 11, 7);
+  word_t *imm = &s->isa.imm;
+  s->isa.rd  = BITS(i, 11, 7);
+  s->isa.rs1 = 0;
+  s->isa.rs2 = 0;
+  *imm = 0;
   switch (type) {
     case TYPE_I: src1R();          immI(); break;
     case TYPE_U:                   immU(); break;
@@ -57,17 +72,43 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
   }
 }
 
-static int decode_exec(Decode *s) {
-  s->dnpc = s->snpc;
+static inline void fetch_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_t *imm) {
+  *rd   = s->isa.rd;
+  *src1 = R(s->isa.rs1);
+  *src2 = R(s->isa.rs2);
+  *imm  = s->isa.imm;
+}
+
+// The addresses of the labels below are kept in `Decode` on purpose.
+#if !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+
+// Execute `n` decoded instructions which are consecutive in the guest
+// memory, starting from `s`. The execution stops early once the control
+// flow leaves the sequential path. `n == 0` only decodes `s`.
+static int decode_exec(Decode *s, int n) {
+  Decode *first = s;
 
+// A matched pattern only records its operands and the address of its
+// execute body. The body is entered through `s->exec` after decoding,
+// so that a cached decoding result can jump to it directly.
 #define INSTPAT_INST(s) ((s)->isa.inst)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
-  int rd = 0; \
-  word_t src1 = 0, src2 = 0, imm = 0; \
-  decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
-  __VA_ARGS__ ; \
+  decode_operand(s, concat(TYPE_, type)); \
+  s->exec = &&concat(exec_, name); \
+  if (0) { \
+concat(exec_, name): ; \
+    int rd = 0; \
+    word_t src1 = 0, src2 = 0, imm = 0; \
+    fetch_operand(s, &rd, &src1, &src2, &imm); \
+    __VA_ARGS__ ; \
+    goto exec_end; \
+  } \
 }
 
+  if (s->exec != NULL) goto exec_start;
+
   INSTPAT_START();
   INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U, R(rd) = s->pc + imm);
   INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, R(rd) = Mr(src1 + imm, 1));
@@ -75,7 +116,7 @@ static int decode_exec(Decode *s) {
 
 	//
   INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal    , J, R(rd) = s -> pc + 4; s -> dnpc += imm -4;); // jal指令
-  INSTPAT("0000000 ????? ????? 000 ????? 00100 11", mv     , I, R(rd) = src1); // mv rd, rs1 (addi rd, rs1, 0)
+  INSTPAT("0000000 00000 ????? 000 ????? 00100 11", mv     , I, R(rd) = src1); // mv rd, rs1 (addi rd, rs1, 0)
   INSTPAT("??????? ????? ????? 000 ????? 00100 11", addi   , I, R(rd) = src1 + imm); // addi rd, rs1, imm
   INSTPAT("??????? ????? ????? 010 ????? 01000 11", sw     , S, Mw(src1 + imm, 4, src2)); // sw rs2, offset(rs1)
   INSTPAT("??????? ????? ????? 000 ????? 11001 11", ret    , I, R(rd) = s -> pc + 4; s -> dnpc = (src1 + imm) & ~1); // jalr(ret)指令
@@ -93,16 +134,61 @@ static int decode_exec(Decode *s) {
   INSTPAT("0000000 ????? ????? 010 ????? 01100 11", slt    , R, R(rd) = (int)src1 < (int)src2 ? 1: 0);
 
 	//
+  INSTPAT("??????? ????? ????? 001 ????? 11100 11", csrrw  , I, CSRRX(rd, imm, src1, true));
+  INSTPAT("??????? ????? ????? 010 ????? 11100 11", csrrs  , I, CSRRX(rd, imm, t | src1, s->isa.rs1 != 0));
+  INSTPAT("??????? ????? ????? 011 ????? 11100 11", csrrc  , I, CSRRX(rd, imm, t & ~src1, s->isa.rs1 != 0));
+  INSTPAT("0001001 ????? ????? 000 00000 11100 11", sfence_vma, R, isa_mmu_flush());
   INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , N, NEMUTRAP(s->pc, R(10))); // R(10) is $a0
   INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv    , N, INV(s->pc));
   INSTPAT_END();
 
+  IFDEF(CONFIG_DCACHE, dcache_insert(s));
+  if (n == 0) return 0;
+
+exec_start:
+  // keep cpu.pc at the running instruction for the hooks of its stores
+  IFDEF(CONFIG_ENGINE_THREADED, cpu.pc = s->pc);
+  s->dnpc = s->snpc;
+  goto *(s->exec);
+
+exec_end:
   R(0) = 0; // reset $zero to 0
+#ifdef CONFIG_ENGINE_THREADED
+  // dispatch the next instruction of the block directly
+  if (s != first + n - 1 && s->dnpc == s->snpc && nemu_state.state == NEMU_RUNNING) {
+    s ++;
+    goto exec_start;
+  }
+#endif
 
-  return 0;
+  return s - first + 1;
 }
 
 int isa_exec_once(Decode *s) {
+  if (MUXDEF(CONFIG_DCACHE, dcache_lookup(s), false)) {
+    s->snpc += 4;
+  } else {
+    s->exec = NULL;
+    s->isa.inst = inst_fetch(&s->snpc, 4);
+  }
+  decode_exec(s, 1);
+  return 0;
+}
+
+#ifdef CONFIG_ENGINE_THREADED
+bool isa_decode_once(Decode *s) {
+  s->snpc = s->pc;
+  s->exec = NULL;
   s->isa.inst = inst_fetch(&s->snpc, 4);
-  return decode_exec(s);
+  decode_exec(s, 0);
+  // jal, jalr and system instructions never fall through to the next one
+  switch (BITS(s->isa.inst, 6, 0)) {
+    case 0x6f: case 0x67: case 0x73: return true;
+    default: return false;
+  }
+}
+
+int isa_exec_block(Decode *s, int n) {
+  return decode_exec(s, n);
 }
+#endif
@@ -13,12 +13,18 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
-#ifndef __DEVICE_ALARM_H__
-#define __DEVICE_ALARM_H__
+#ifndef __RISCV_CSR_H__
+#define __RISCV_CSR_H__
 
-#define TIMER_HZ 60
+#include <common.h>
 
-typedef void (*alarm_handler_t) ();
-void add_alarm_handle(alarm_handler_t h);
+#define CSR_SATP 0x180
+
+// satp in Sv32: MODE[31], ASID[30:22], PPN[21:0]
+#define SATP_MODE(satp) BITS(satp, 31, 31)
+#define SATP_PPN(satp)  BITS(satp, 21, 0)
+
+word_t csr_read(uint32_t idx);
+void csr_write(uint32_t idx, word_t val);
 
 #endif
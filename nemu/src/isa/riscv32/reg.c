@@ -15,6 +15,7 @@
 
 #include <isa.h>
 #include "local-include/reg.h"
+#include "local-include/csr.h"
 
 const char *regs[] = {
   "$0", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
@@ -28,6 +29,7 @@ void isa_reg_display() {
 	for(int i=0;i<length;i++){
 		printf("%s : 0x%08x\n",regs[i],cpu.gpr[i]);
 	}
+	printf("satp : 0x%08x\n",cpu.satp);
 }
 //获取寄存器的值
 word_t isa_reg_str2val(const char *s, bool *success) {
@@ -43,3 +45,26 @@ word_t isa_reg_str2val(const char *s, bool *success) {
 	*success = false;
   return 0;
 }
+
+//获取寄存器的地址, 用于编译后的表达式直接读寄存器
+word_t* isa_reg_str2ptr(const char *s) {
+	const char *s_reg = s + 1;
+	for(int i = 0; i < ARRLEN(regs); i++){
+		if(strcmp(s_reg, regs[i]) == 0) return &cpu.gpr[i];
+	}
+	return NULL;
+}
+
+word_t csr_read(uint32_t idx) {
+  switch (idx) {
+    case CSR_SATP: return cpu.satp;
+    default: panic("unsupported CSR 0x%03x", idx);
+  }
+}
+
+void csr_write(uint32_t idx, word_t val) {
+  switch (idx) {
+    case CSR_SATP: cpu.satp = val; isa_mmu_flush(); break;
+    default: panic("unsupported CSR 0x%03x", idx);
+  }
+}
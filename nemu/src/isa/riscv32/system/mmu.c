@@ -16,7 +16,77 @@
 #include <isa.h>
 #include <memory/vaddr.h>
 #include <memory/paddr.h>
+#include "../local-include/csr.h"
+
+/* Sv32 translation. Successful walks are cached in a direct-mapped TLB
+ * indexed by the virtual page number, so a hit costs a single lookup
+ * instead of two page table reads through paddr_read(). Superpages are
+ * cached as 4KB pages. Privilege modes are not modeled, so the U bit is
+ * ignored. The A and D bits are set by the walker.
+ */
+#define TLB_BITS 6
+#define TLB_SIZE (1 << TLB_BITS)
+#define TLB_INVALID ((uint32_t)-1) // never equal to a 20-bit VPN
+
+#define PTE_V 0x01
+#define PTE_R 0x02
+#define PTE_W 0x04
+#define PTE_X 0x08
+#define PTE_A 0x40
+#define PTE_D 0x80
+#define PTE_PPN(pte) BITS(pte, 31, 10)
+
+#define VPN(vaddr, level) BITS(vaddr, 21 + 10 * (level), 12 + 10 * (level))
+
+typedef struct {
+  uint32_t vpn;
+  paddr_t ppage; // physical page base
+  word_t pte;    // flags of the leaf PTE
+} TLBEntry;
+
+static TLBEntry tlb[TLB_SIZE] = { [0 ... TLB_SIZE - 1] = { .vpn = TLB_INVALID } };
+
+// the permission needed by each MEM_TYPE_*
+static const word_t perm[] = { PTE_X, PTE_R, PTE_W };
+
+// drop all cached translations, called on satp writes and sfence.vma
+void isa_mmu_flush() {
+  for (int i = 0; i < TLB_SIZE; i ++) { tlb[i].vpn = TLB_INVALID; }
+  vaddr_flush();
+}
+
+// walk the page table, and fill `e` on success
+static bool ptw(vaddr_t vaddr, int type, TLBEntry *e) {
+  paddr_t base = (paddr_t)SATP_PPN(cpu.satp) << PAGE_SHIFT;
+  for (int level = 1; level >= 0; level --) {
+    paddr_t pte_addr = base + VPN(vaddr, level) * 4;
+    word_t pte = paddr_read(pte_addr, 4);
+    if (!(pte & PTE_V) || ((pte & (PTE_R | PTE_W)) == PTE_W)) return false;
+    if (!(pte & (PTE_R | PTE_X))) {
+      // pointer to the next level
+      base = (paddr_t)PTE_PPN(pte) << PAGE_SHIFT;
+      continue;
+    }
+    // leaf, a superpage should be aligned
+    if (level == 1 && BITS(pte, 19, 10) != 0) return false;
+    if (!(pte & perm[type])) return false;
+    word_t new_pte = pte | PTE_A | (type == MEM_TYPE_WRITE ? PTE_D : 0);
+    if (new_pte != pte) paddr_write(pte_addr, 4, new_pte);
+    paddr_t ppage = (paddr_t)PTE_PPN(pte) << PAGE_SHIFT;
+    if (level == 1) ppage |= vaddr & 0x3ff000;
+    e->vpn = vaddr >> PAGE_SHIFT;
+    e->ppage = ppage;
+    e->pte = new_pte;
+    return true;
+  }
+  return false;
+}
 
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type) {
-  return MEM_RET_FAIL;
+  TLBEntry *e = &tlb[(vaddr >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+  // a write to a clean page should walk again to set the D bit
+  bool hit = e->vpn == (vaddr >> PAGE_SHIFT) && (e->pte & perm[type]) &&
+    (type != MEM_TYPE_WRITE || (e->pte & PTE_D));
+  if (unlikely(!hit) && !ptw(vaddr, type, e)) return MEM_RET_FAIL;
+  return e->ppage | MEM_RET_OK;
 }
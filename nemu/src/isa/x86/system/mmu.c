@@ -20,3 +20,7 @@
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type) {
   return MEM_RET_FAIL;
 }
+
+void isa_mmu_flush() {
+  vaddr_flush();
+}
@@ -15,15 +15,27 @@
 
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <device/mmio.h>
+#include <cpu/cpu.h>
 #include <isa.h>
 
-#if   defined(CONFIG_PMEM_MALLOC)
+#if   defined(CONFIG_PMEM_MALLOC) || defined(CONFIG_PMEM_MMAP)
 static uint8_t *pmem = NULL;
 #else // CONFIG_PMEM_GARRAY
 static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
 #endif
 
+#define NR_PAGE (CONFIG_MSIZE >> PAGE_SHIFT)
+#define MAX_CODE_HOOK 4
+
+// one bit per pmem page, with a spare word for stores at the end of pmem
+static uint64_t code_map[NR_PAGE / 64 + 1] = {};
+static code_hook_t code_hook[MAX_CODE_HOOK] = {};
+static int nr_code_hook = 0;
+static uint64_t watch_map[NR_PAGE / 64 + 1] = {};
+static watch_hook_t watch_hook = NULL;
+
 uint8_t* guest_to_host(paddr_t paddr) { return pmem + paddr - CONFIG_MBASE; }
 paddr_t host_to_guest(uint8_t *haddr) { return haddr - pmem + CONFIG_MBASE; }
 
@@ -36,6 +48,189 @@ static void pmem_write(paddr_t addr, int len, word_t data) {
   host_write(guest_to_host(addr), len, data);
 }
 
+static inline bool code_bit(paddr_t addr) {
+  paddr_t pg = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  return (code_map[pg / 64] >> (pg % 64)) & 1;
+}
+
+void paddr_add_code_hook(code_hook_t hook) {
+  Assert(nr_code_hook < MAX_CODE_HOOK, "too many code hooks");
+  code_hook[nr_code_hook ++] = hook;
+}
+
+// return whether the page of `addr` becomes a code page by this call,
+// pages are not tracked if no one is interested in them
+bool paddr_mark_code(paddr_t addr) {
+  if (nr_code_hook == 0 || !in_pmem(addr) || code_bit(addr)) return false;
+  paddr_t pg = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  code_map[pg / 64] |= 1ull << (pg % 64);
+  return true;
+}
+
+bool paddr_is_code(paddr_t addr) {
+  return in_pmem(addr) && code_bit(addr);
+}
+
+static void code_written(paddr_t addr, int len) {
+  for (int i = 0; i < nr_code_hook; i ++) { code_hook[i](addr, len); }
+}
+
+static inline bool watch_bit(paddr_t addr) {
+  paddr_t pg = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  return (watch_map[pg / 64] >> (pg % 64)) & 1;
+}
+
+// whether the page is a code page or watched, with one test
+static inline bool hooked_bit(paddr_t addr) {
+  paddr_t pg = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  return ((code_map[pg / 64] | watch_map[pg / 64]) >> (pg % 64)) & 1;
+}
+
+void paddr_set_watch_hook(watch_hook_t hook) {
+  watch_hook = hook;
+}
+
+bool paddr_watch(paddr_t addr, word_t len) {
+  paddr_t last = addr + len - 1;
+  if (len == 0 || last < addr || !in_pmem(addr) || !in_pmem(last)) return false;
+  for (paddr_t pg = (addr - CONFIG_MBASE) >> PAGE_SHIFT; pg <= (last - CONFIG_MBASE) >> PAGE_SHIFT; pg ++) {
+    watch_map[pg / 64] |= 1ull << (pg % 64);
+  }
+  stlb_flush();
+  IFDEF(CONFIG_ENGINE_JIT, jit_update_watch());
+  return true;
+}
+
+void paddr_unwatch_all() {
+  memset(watch_map, 0, sizeof(watch_map));
+  IFDEF(CONFIG_ENGINE_JIT, jit_update_watch());
+}
+
+bool paddr_is_watched(paddr_t addr) {
+  return in_pmem(addr) && watch_bit(addr);
+}
+
+static void hooked_write(paddr_t addr, int len, word_t data) {
+  if ((watch_bit(addr) | watch_bit(addr + len - 1)) && watch_hook != NULL) {
+    watch_hook(addr, len, pmem_read(addr, len), data);
+  }
+  pmem_write(addr, len, data);
+  if (code_bit(addr) | code_bit(addr + len - 1)) code_written(addr, len);
+}
+
+#ifdef CONFIG_PMEM_MMAP
+#include <sys/mman.h>
+#include <signal.h>
+
+#define HUGE_PAGE_SIZE (2ul << 20)
+
+#ifdef CONFIG_MEM_RANDOM
+/* pmem is mapped inaccessible at first, and each chunk is filled with the
+ * random byte by the SIGSEGV handler when it is touched for the first
+ * time. A chunk is a huge page, so it is faulted in as one.
+ */
+#define NR_CHUNK ((CONFIG_MSIZE + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE)
+static bool chunk_ready[NR_CHUNK] = {};
+static uint8_t fill_byte = 0;
+
+static size_t chunk_size(size_t off) {
+  return (CONFIG_MSIZE - off < HUGE_PAGE_SIZE ? CONFIG_MSIZE - off : HUGE_PAGE_SIZE);
+}
+
+// fill the chunk except [skip_l, skip_r), which are offsets in pmem
+static bool fill_chunk(size_t idx, size_t skip_l, size_t skip_r) {
+  size_t off = idx * HUGE_PAGE_SIZE;
+  size_t end = off + chunk_size(off);
+  if (mprotect(pmem + off, end - off, PROT_READ | PROT_WRITE) != 0) return false;
+  if (skip_l < off) skip_l = off;
+  if (skip_r > end) skip_r = end;
+  if (skip_l >= skip_r) skip_l = skip_r = end;
+  memset(pmem + off, fill_byte, skip_l - off);
+  memset(pmem + skip_r, fill_byte, end - skip_r);
+  chunk_ready[idx] = true;
+  return true;
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *ucontext) {
+  uint8_t *addr = info->si_addr;
+  if (addr >= pmem && addr < pmem + CONFIG_MSIZE) {
+    size_t idx = (addr - pmem) / HUGE_PAGE_SIZE;
+    if (!chunk_ready[idx] && fill_chunk(idx, 0, 0)) return;
+  }
+  // a real segmentation fault, crash at the faulting instruction
+  signal(SIGSEGV, SIG_DFL);
+}
+#endif
+
+static void init_pmem() {
+  // align pmem to huge pages
+  size_t size = CONFIG_MSIZE + HUGE_PAGE_SIZE;
+  int prot = MUXDEF(CONFIG_MEM_RANDOM, PROT_NONE, PROT_READ | PROT_WRITE);
+  uint8_t *p = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(p != MAP_FAILED, "fail to map pmem");
+  pmem = (uint8_t *)ROUNDUP(p, HUGE_PAGE_SIZE);
+  if (pmem > p) munmap(p, pmem - p);
+  munmap(pmem + CONFIG_MSIZE, p + size - (pmem + CONFIG_MSIZE));
+  madvise(pmem, CONFIG_MSIZE, MADV_HUGEPAGE);
+#ifdef CONFIG_MEM_RANDOM
+  fill_byte = rand();
+  // checkpoints skip untouched chunks, which are filled again after restored
+  checkpoint_add("pmem chunk map", chunk_ready, sizeof(chunk_ready), NULL);
+  checkpoint_add("pmem fill byte", &fill_byte, sizeof(fill_byte), NULL);
+  struct sigaction sa = { .sa_sigaction = segv_handler, .sa_flags = SA_SIGINFO };
+  sigemptyset(&sa.sa_mask);
+  Assert(sigaction(SIGSEGV, &sa, NULL) == 0, "fail to install the SIGSEGV handler");
+#endif
+}
+#endif
+
+// System calls can not fill the lazily initialized pmem, so this
+// should be called before passing [addr, addr + len) to them.
+void pmem_prepare(paddr_t addr, size_t len) {
+#if defined(CONFIG_PMEM_MMAP) && defined(CONFIG_MEM_RANDOM)
+  if (len == 0) return;
+  size_t off = addr - CONFIG_MBASE;
+  for (size_t i = off / HUGE_PAGE_SIZE; i <= (off + len - 1) / HUGE_PAGE_SIZE; i ++) {
+    if (!chunk_ready[i]) Assert(fill_chunk(i, 0, 0), "fail to initialize pmem");
+  }
+#endif
+}
+
+// The same as pmem_prepare(), but all of [addr, addr + len) is going to be
+// overwritten or mapped over by the caller, so only the rest of the chunks
+// is filled.
+void pmem_prepare_overwrite(paddr_t addr, size_t len) {
+#if defined(CONFIG_PMEM_MMAP) && defined(CONFIG_MEM_RANDOM)
+  if (len == 0) return;
+  size_t off = addr - CONFIG_MBASE;
+  for (size_t i = off / HUGE_PAGE_SIZE; i <= (off + len - 1) / HUGE_PAGE_SIZE; i ++) {
+    if (!chunk_ready[i]) Assert(fill_chunk(i, off, off + len), "fail to initialize pmem");
+  }
+#endif
+}
+
+// whether the page at `addr` has been touched, untouched pages are still
+// waiting for the random filling
+bool pmem_touched(paddr_t addr) {
+#if defined(CONFIG_PMEM_MMAP) && defined(CONFIG_MEM_RANDOM)
+  return chunk_ready[(addr - CONFIG_MBASE) / HUGE_PAGE_SIZE];
+#else
+  return true;
+#endif
+}
+
+// pmem has been replaced by a new readable and writable mapping, or the map
+// of touched chunks has been restored, so hide the untouched chunks again
+void pmem_remapped() {
+#if defined(CONFIG_PMEM_MMAP) && defined(CONFIG_MEM_RANDOM)
+  for (size_t i = 0; i < NR_CHUNK; i ++) {
+    size_t off = i * HUGE_PAGE_SIZE;
+    int prot = (chunk_ready[i] ? PROT_READ | PROT_WRITE : PROT_NONE);
+    Assert(mprotect(pmem + off, chunk_size(off), prot) == 0, "fail to protect pmem");
+  }
+#endif
+}
+
 static void out_of_bound(paddr_t addr) {
   panic("address = " FMT_PADDR " is out of bound of pmem [" FMT_PADDR ", " FMT_PADDR "] at pc = " FMT_WORD,
       addr, PMEM_LEFT, PMEM_RIGHT, cpu.pc);
@@ -45,8 +240,12 @@ void init_mem() {
 #if   defined(CONFIG_PMEM_MALLOC)
   pmem = malloc(CONFIG_MSIZE);
   assert(pmem);
+#elif defined(CONFIG_PMEM_MMAP)
+  init_pmem();
 #endif
+#ifndef CONFIG_PMEM_MMAP
   IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
+#endif
   Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
 }
 
@@ -58,7 +257,11 @@ word_t paddr_read(paddr_t addr, int len) {
 }
 
 void paddr_write(paddr_t addr, int len, word_t data) {
-  if (likely(in_pmem(addr))) { pmem_write(addr, len, data); return; }
+  if (likely(in_pmem(addr))) {
+    if (unlikely(hooked_bit(addr) | hooked_bit(addr + len - 1))) hooked_write(addr, len, data);
+    else pmem_write(addr, len, data);
+    return;
+  }
   IFDEF(CONFIG_DEVICE, mmio_write(addr, len, data); return);
   out_of_bound(addr);
 }
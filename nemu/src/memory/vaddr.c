@@ -15,15 +15,112 @@
 
 #include <isa.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <cpu/difftest.h>
+#include <cpu/ifetch.h>
+#include <memory/mtrace.h>
 
-word_t vaddr_ifetch(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+STLBEntry stlb[3][STLB_SIZE] = {
+  [0 ... 2] = { [0 ... STLB_SIZE - 1] = { .tag = STLB_INVALID } }
+};
+
+IFetchWindow ifetch_win = { .page = STLB_INVALID };
+
+void stlb_flush() {
+  for (int t = 0; t < 3; t ++) {
+    for (int i = 0; i < STLB_SIZE; i ++) { stlb[t][i].tag = STLB_INVALID; }
+  }
+  ifetch_win.page = STLB_INVALID;
+}
+
+// drop everything cached by virtual address, called when the mapping changes
+void vaddr_flush() {
+  stlb_flush();
+  IFDEF(CONFIG_DCACHE, dcache_flush());
+  IFDEF(CONFIG_ENGINE_THREADED, tcache_flush());
+  IFDEF(CONFIG_ENGINE_JIT, jit_flush());
+}
+
+static paddr_t vaddr_translate(vaddr_t addr, int len, int type) {
+  switch (isa_mmu_check(addr, len, type)) {
+    case MMU_DIRECT: return addr;
+    case MMU_TRANSLATE: {
+      paddr_t pg = isa_mmu_translate(addr, len, type);
+      Assert((pg & PAGE_MASK) == MEM_RET_OK,
+          "page fault at vaddr = " FMT_WORD ", type = %d", addr, type);
+      return (pg & ~(paddr_t)PAGE_MASK) | (addr & PAGE_MASK);
+    }
+    default: panic("unsupported MMU mode at vaddr = " FMT_WORD, addr);
+  }
+}
+
+// an access crossing a page is split into bytes if the pages are translated
+static inline bool split_access(vaddr_t addr, int len, int type) {
+  return unlikely(((addr ^ (addr + len - 1)) & ~(vaddr_t)PAGE_MASK) != 0) &&
+    isa_mmu_check(addr, len, type) == MMU_TRANSLATE;
+}
+
+// drop the write entries of a page which has just become a code page
+static void stlb_drop_write(paddr_t ppage) {
+  uintptr_t host = (uintptr_t)guest_to_host(ppage);
+  for (int i = 0; i < STLB_SIZE; i ++) {
+    STLBEntry *e = &stlb[MEM_TYPE_WRITE][i];
+    if (e->tag != STLB_INVALID && e->tag + e->addend == host) { e->tag = STLB_INVALID; }
+  }
+}
+
+// remember the page of `addr` if it is backed by pmem
+static void stlb_fill(int type, vaddr_t addr, paddr_t paddr) {
+  paddr_t ppage = paddr & ~(paddr_t)PAGE_MASK;
+  if (!in_pmem(ppage)) return;
+  IFDEF(CONFIG_MTRACE, if (type != MEM_TYPE_IFETCH && mtrace_page(ppage)) return);
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, if (type == MEM_TYPE_WRITE) return);
+  if (type == MEM_TYPE_IFETCH) {
+    if (paddr_mark_code(ppage)) stlb_drop_write(ppage);
+  } else if (type == MEM_TYPE_WRITE && (paddr_is_code(ppage) || paddr_is_watched(ppage))) {
+    return;
+  }
+  STLBEntry *e = stlb_entry(type, addr);
+  vaddr_t vpage = addr & ~(vaddr_t)PAGE_MASK;
+  e->tag = vpage;
+  e->addend = (uintptr_t)guest_to_host(ppage) - vpage;
+}
+
+word_t vaddr_read_slow(vaddr_t addr, int len, int type) {
+  if (split_access(addr, len, type)) {
+    word_t data = 0;
+    for (int i = 0; i < len; i ++) { data |= vaddr_read_slow(addr + i, 1, type) << (i * 8); }
+    return data;
+  }
+  paddr_t paddr = vaddr_translate(addr, len, type);
+  stlb_fill(type, addr, paddr);
+  word_t data = paddr_read(paddr, len);
+  IFDEF(CONFIG_MTRACE, if (type != MEM_TYPE_IFETCH) mtrace(paddr, len, data, false));
+  return data;
 }
 
-word_t vaddr_read(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+// move the fetch window to the page of `pc` if it is cached in the soft TLB
+word_t inst_fetch_slow(vaddr_t pc, int len) {
+  word_t inst = vaddr_ifetch(pc, len);
+  STLBEntry *e = stlb_entry(MEM_TYPE_IFETCH, pc);
+  vaddr_t page = pc & ~(vaddr_t)PAGE_MASK;
+  if (e->tag == page) {
+    ifetch_win.page = page;
+    ifetch_win.host = (uint8_t *)(page + e->addend);
+  }
+  return inst;
 }
 
-void vaddr_write(vaddr_t addr, int len, word_t data) {
-  paddr_write(addr, len, data);
+void vaddr_write_slow(vaddr_t addr, int len, word_t data) {
+  if (split_access(addr, len, MEM_TYPE_WRITE)) {
+    for (int i = 0; i < len; i ++) { vaddr_write_slow(addr + i, 1, data >> (i * 8)); }
+    return;
+  }
+  paddr_t paddr = vaddr_translate(addr, len, MEM_TYPE_WRITE);
+  stlb_fill(MEM_TYPE_WRITE, addr, paddr);
+  paddr_write(paddr, len, data);
+  IFDEF(CONFIG_MTRACE, mtrace(paddr, len, data, true));
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, if (in_pmem(paddr)) difftest_store(paddr, len, data));
 }
@@ -15,6 +15,7 @@
 
 #include <isa.h>
 #include <memory/paddr.h>
+#include <memory/mtrace.h>
 
 void init_rand();
 void init_log(const char *log_file);
@@ -23,6 +24,7 @@ void init_difftest(char *ref_so_file, long img_size, int port);
 void init_device();
 void init_sdb();
 void init_disasm();
+void init_btrace(const char *file);
 
 static void welcome() {
   Log("Trace: %s", MUXDEF(CONFIG_TRACE, ANSI_FMT("ON", ANSI_FG_GREEN), ANSI_FMT("OFF", ANSI_FG_RED)));
@@ -38,10 +40,17 @@ static void welcome() {
 #include <getopt.h>
 
 void sdb_set_batch_mode();
+void sdb_set_gdb(char *target);
+void sdb_set_save(char *file, uint64_t nr_inst);
 
 static char *log_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
+static char *restore_file = NULL;
+static char *save_file = NULL;
+static char *btrace_file = NULL;
+static char *mtrace_file = NULL;
+static uint64_t save_at = 0;
 static int difftest_port = 1234;
 
 static long load_img() {
@@ -50,6 +59,9 @@ static long load_img() {
     return 4096; // built-in image size
   }
 
+  long elf_size = elf_load(img_file);
+  if (elf_size >= 0) return elf_size;
+
   FILE *fp = fopen(img_file, "rb");
   Assert(fp, "Can not open '%s'", img_file);
 
@@ -59,6 +71,7 @@ static long load_img() {
   Log("The image is %s, size = %ld", img_file, size);
 
   fseek(fp, 0, SEEK_SET);
+  pmem_prepare_overwrite(RESET_VECTOR, size);
   int ret = fread(guest_to_host(RESET_VECTOR), size, 1, fp);
   assert(ret == 1);
 
@@ -66,22 +79,48 @@ static long load_img() {
   return size;
 }
 
+static void parse_mtrace_range(char *arg) {
+#ifdef CONFIG_MTRACE
+  char *end = NULL;
+  paddr_t start = strtoull(arg, &end, 0);
+  uint64_t len = (*end == ',' ? strtoull(end + 1, &end, 0) : 0);
+  bool ok = (*end == '\0' && len > 0 && mtrace_add(start, start + len - 1));
+  Assert(ok, "invalid memory range '%s', it should be ADDR,LEN", arg);
+#else
+  Log("CONFIG_MTRACE is not enabled, --mtrace-range=%s is ignored", arg);
+#endif
+}
+
 static int parse_args(int argc, char *argv[]) {
   const struct option table[] = {
     {"batch"    , no_argument      , NULL, 'b'},
     {"log"      , required_argument, NULL, 'l'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"restore"  , required_argument, NULL, 'r'},
+    {"save"     , required_argument, NULL, 's'},
+    {"save-at"  , required_argument, NULL, 'S'},
+    {"btrace"   , required_argument, NULL, 't'},
+    {"mtrace"   , required_argument, NULL, 'm'},
+    {"mtrace-range", required_argument, NULL, 'M'},
+    {"gdb"      , required_argument, NULL, 'g'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhl:d:p:r:s:t:m:g:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 'r': restore_file = optarg; break;
+      case 's': save_file = optarg; break;
+      case 'S': sscanf(optarg, "%" SCNu64, &save_at); break;
+      case 't': btrace_file = optarg; break;
+      case 'm': mtrace_file = optarg; break;
+      case 'M': parse_mtrace_range(optarg); break;
+      case 'g': sdb_set_gdb(optarg); break;
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
@@ -89,6 +128,13 @@ static int parse_args(int argc, char *argv[]) {
         printf("\t-l,--log=FILE           output log to FILE\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        printf("\t-r,--restore=FILE       restore the checkpoint FILE after loading the image\n");
+        printf("\t-s,--save=FILE          save a checkpoint to FILE, see --save-at\n");
+        printf("\t   --save-at=N          save the checkpoint after N instructions (default 0)\n");
+        printf("\t-t,--btrace=FILE        write the binary instruction trace to FILE\n");
+        printf("\t-m,--mtrace=FILE        write the memory access trace to FILE\n");
+        printf("\t   --mtrace-range=ADDR,LEN  trace the memory accesses to [ADDR, ADDR+LEN)\n");
+        printf("\t-g,--gdb=PORT|PATH      wait for gdb on PORT of localhost or on the Unix socket PATH\n");
         printf("\n");
         exit(0);
     }
@@ -123,11 +169,19 @@ void init_monitor(int argc, char *argv[]) {
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
 
+  /* Restore the checkpoint. This will overwrite the image, and REF is synced with it. */
+  if (restore_file != NULL) { Assert(checkpoint_load(restore_file), "fail to restore %s", restore_file); }
+  if (save_file != NULL) { sdb_set_save(save_file, save_at); }
+
   /* Initialize the simple debugger. */
   init_sdb();
 
   IFDEF(CONFIG_ITRACE, init_disasm());
 
+  IFDEF(CONFIG_BTRACE, init_btrace(btrace_file));
+
+  IFDEF(CONFIG_MTRACE, init_mtrace(mtrace_file));
+
   /* Display welcome message. */
   welcome();
 }
@@ -0,0 +1,185 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include "sdb.h"
+
+#define NR_BP 32
+
+typedef struct {
+	bool used;
+	vaddr_t pc;
+	char *cond;                  //条件表达式, 没有条件时为NULL
+	Expr *prog;                  //编译后的条件
+	uint64_t hit;                //命中次数(条件成立的次数)
+	uint64_t ignore;             //还要忽略的命中次数
+} BP;
+
+static BP bp_pool[NR_BP] = {};
+static int g_nr_bp = 0;
+static bool hit = false;                 //上次运行是否在断点处暂停
+
+#ifdef CONFIG_BREAKPOINT
+uint64_t bp_map[(1 << BP_MAP_BITS) / 64] = {};
+#endif
+
+//按所有断点重新设置pc的位图, 已翻译的代码块可能跨过了新断点, 要全部丢弃
+static void update_map(){
+	IFDEF(CONFIG_BREAKPOINT, memset(bp_map, 0, sizeof(bp_map)));
+	g_nr_bp = 0;
+	for(int i = 0; i < NR_BP; i++){
+		if(!bp_pool[i].used) continue;
+#ifdef CONFIG_BREAKPOINT
+		uint32_t idx = BP_MAP_IDX(bp_pool[i].pc);
+		bp_map[idx / 64] |= 1ull << (idx % 64);
+#endif
+		g_nr_bp++;
+	}
+	IFDEF(CONFIG_ENGINE_THREADED, tcache_flush());
+	IFDEF(CONFIG_ENGINE_JIT, jit_flush());
+}
+
+static void bp_clear(BP *bp){
+	free(bp->cond);
+	expr_free(bp->prog);
+	*bp = (BP){};
+}
+
+// 在编号NO处设置断点, 返回是否成功
+static bool bp_set(int NO, vaddr_t pc, const char *cond, uint64_t hit, uint64_t ignore){
+	BP *bp = &bp_pool[NO];
+	if(cond != NULL){
+		bool success = true;
+		bp->cond = strdup(cond);
+		bp->prog = expr_compile(bp->cond, &success);
+		if(!success){ bp_clear(bp); return false; }
+	}
+	bp->used = true;
+	bp->pc = pc;
+	bp->hit = hit;
+	bp->ignore = ignore;
+	update_map();
+	return true;
+}
+
+static int bp_alloc(){          //返回一个空闲断点的编号, 没有时返回-1
+	for(int NO = 0; NO < NR_BP; NO++){
+		if(!bp_pool[NO].used) return NO;
+	}
+	return -1;
+}
+
+void new_bp(vaddr_t pc, char *cond){
+	IFNDEF(CONFIG_BREAKPOINT, printf("断点没有启用, 请打开CONFIG_BREAKPOINT\n"); return);
+	int NO = bp_alloc();
+	if(NO < 0){ printf("No free breakpoints available\n"); return; }
+	if(!bp_set(NO, pc, cond, 0, 0)){ printf("Failed to compile condition: %s\n", cond); return; }
+	printf("Breakpoint %d at " FMT_WORD "%s%s\n", NO, pc, (cond ? " if " : ""), (cond ? cond : ""));
+}
+
+void free_bp(int NO){
+	if(NO < 0 || NO >= NR_BP || !bp_pool[NO].used){ printf("No breakpoint %d\n", NO); return; }
+	bp_clear(&bp_pool[NO]);
+	update_map();
+}
+
+void bp_set_ignore(int NO, uint64_t n){
+	if(NO < 0 || NO >= NR_BP || !bp_pool[NO].used){ printf("No breakpoint %d\n", NO); return; }
+	bp_pool[NO].ignore = n;
+	printf("Will ignore next %" PRIu64 " hits of breakpoint %d\n", n, NO);
+}
+
+void bp_display(){
+	if(g_nr_bp == 0){ printf("No breakpoint\n"); return; }
+	for(int i = 0; i < NR_BP; i++){
+		BP *bp = &bp_pool[i];
+		if(!bp->used) continue;
+		printf("Breakpoint %d : " FMT_WORD " hit %" PRIu64 " times", i, bp->pc, bp->hit);
+		if(bp->cond) printf(", if %s", bp->cond);
+		if(bp->ignore) printf(", ignore next %" PRIu64 " hits", bp->ignore);
+		printf("\n");
+	}
+}
+
+//位图命中后才调用, 检查pc处的断点和条件, 命中时暂停
+void bp_check(vaddr_t pc){
+	for(int i = 0; i < NR_BP; i++){
+		BP *bp = &bp_pool[i];
+		if(!bp->used || bp->pc != pc) continue;
+		if(bp->prog != NULL){
+			expr_update(bp->prog);
+			if(!expr_run(bp->prog)) continue;
+		}
+		bp->hit++;
+		if(bp->ignore > 0){ bp->ignore--; continue; }
+		if(g_quiet){ quiet_stop(); continue; }  //反向执行的搜索只要暂停
+		nemu_state.state = NEMU_STOP;
+		hit = true;
+		printf("Breakpoint %d at " FMT_WORD ", hit %" PRIu64 " times\n", i, pc, bp->hit);
+	}
+}
+
+int bp_save(char *buf, int size){     //把断点写成"NO PC HIT IGNORE [COND]\0"的序列, 用于快照之间传递, 返回长度
+	int len = 0;
+	for(int i = 0; i < NR_BP; i++){
+		BP *bp = &bp_pool[i];
+		if(!bp->used) continue;
+		int n = snprintf(buf + len, size - len, "%d " FMT_WORD " %" PRIu64 " %" PRIu64 " %s",
+				i, bp->pc, bp->hit, bp->ignore, (bp->cond ? bp->cond : "")) + 1;
+		if(len + n > size) break;
+		len += n;
+	}
+	return len;
+}
+
+void bp_restore(const char *buf, int len){    //用bp_save()的结果替换当前的断点
+	for(int i = 0; i < NR_BP; i++) bp_clear(&bp_pool[i]);
+	for(const char *p = buf; p < buf + len; p += strlen(p) + 1){
+		char *e = NULL;
+		int NO = strtol(p, &e, 10);
+		vaddr_t pc = strtoull(e, &e, 16);
+		uint64_t hit = strtoull(e, &e, 10);
+		uint64_t ignore = strtoull(e, &e, 10);
+		assert(NO >= 0 && NO < NR_BP && *e == ' ');
+		bool ok = bp_set(NO, pc, (e[1] ? e + 1 : NULL), hit, ignore);
+		assert(ok);
+	}
+	update_map();
+}
+
+bool bp_insert(vaddr_t pc){         //不输出地添加无条件断点, 用于gdb的Z0/Z1
+	IFNDEF(CONFIG_BREAKPOINT, return false);
+	int NO = bp_alloc();
+	return NO >= 0 && bp_set(NO, pc, NULL, 0, 0);
+}
+
+bool bp_remove(vaddr_t pc){         //删除pc处的一个无条件断点
+	for(int i = 0; i < NR_BP; i++){
+		if(bp_pool[i].used && bp_pool[i].pc == pc && bp_pool[i].cond == NULL){
+			bp_clear(&bp_pool[i]);
+			update_map();
+			return true;
+		}
+	}
+	return false;
+}
+
+bool bp_last_hit(){                 //上次运行是否在断点处暂停, 读取后清除
+	bool ret = hit;
+	hit = false;
+	return ret;
+}
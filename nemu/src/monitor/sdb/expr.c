@@ -14,6 +14,7 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include "sdb.h"
 
 /* We use the POSIX regex functions to process regular expressions.
  * Type 'man regex' for more information about POSIX regex functions.
@@ -168,34 +169,70 @@ bool check_parentheses(int p,int q){
 	return stk==0;
 }
 
-int eval(int p,int q){
+/* 表达式只在new_wp()等处编译一次, 编译成后缀形式的字节码, 之后求值时不需要
+ * 再做词法分析. 表达式依赖的寄存器和内存字是它的输入(input), 求值时用的是
+ * 输入的缓存值; expr_update()刷新缓存并返回输入是否变化, 输入没有变化时表达式
+ * 的值也不会变化, 不需要重新求值.
+ */
+typedef struct {
+	int type;             // TK_NUM, TK_REG, TK_DEREF或者运算符
+	word_t val;           // TK_NUM的值, TK_REG和TK_DEREF的输入编号
+} Inst;
+
+typedef struct {
+	int type;             // TK_REG或TK_DEREF
+	const word_t *reg;
+	paddr_t addr;
+	word_t val;           // 缓存值
+} Input;
+
+struct Expr {
+	int nr_inst, nr_input;
+	Inst *inst;
+	Input *input;
+	word_t *stack;
+};
+
+static int add_input(Expr *ex, int type, const word_t *reg, paddr_t addr){
+	for(int i = 0; i < ex->nr_input; i++){
+		if(ex->input[i].type == type && ex->input[i].reg == reg && ex->input[i].addr == addr) return i;
+	}
+	ex->input[ex->nr_input] = (Input){ .type = type, .reg = reg, .addr = addr };
+	return ex->nr_input++;
+}
+
+static void emit(Expr *ex, int type, word_t val){
+	ex->inst[ex->nr_inst++] = (Inst){ .type = type, .val = val };
+}
+
+//把tokens[p..q]编译成后缀形式, 找op的方法和原来求值时一样
+static bool compile(Expr *ex, int p, int q){
 	if(p>q){
-		panic("p>q");
+		return false;
 	}
 	else if(p == q){         //This is a number or a reg  读数字或者从寄存器里读数值
-			if(tokens[p].type == TK_REG){
-			bool success = true;
-			int res = isa_reg_str2val(tokens[p].str,&success); 
-			Assert(success,"reg读值不成功");
-			return res;
+		if(tokens[p].type == TK_REG){
+			const word_t *reg = isa_reg_str2ptr(tokens[p].str);
+			if(reg == NULL) { printf("unknown register %s\n", tokens[p].str); return false; }
+			emit(ex, TK_REG, add_input(ex, TK_REG, reg, 0));
+			return true;
 		}
-		int val = 0;
-		sscanf(tokens[p].str,"%d",&val);
-		return val;	
+		if(tokens[p].type != TK_NUM && tokens[p].type != TK_HEX) return false;
+		//十进制数不按前导0当作八进制
+		emit(ex, TK_NUM, strtoul(tokens[p].str, NULL, tokens[p].type == TK_HEX ? 16 : 10));
+		return true;
 	}
 	else if(check_parentheses(p, q) == true){  // 括号匹配检查
-		return eval(p+1,q-1);
+		return compile(ex, p+1, q-1);
 	}
 	else if(p + 1 == q){    // 从内存中读取数值
 		if(tokens[p].type == TK_DEREF && tokens[q].type == TK_HEX){
-			paddr_t addr = 0;
-			sscanf(tokens[q].str, "%x", &addr);
-			return paddr_read(addr,4);	
+			paddr_t addr = strtoul(tokens[q].str, NULL, 16);
+			emit(ex, TK_DEREF, add_input(ex, TK_DEREF, NULL, addr));
+			return true;
 		}
-		else{
-			printf("%d %d\n", tokens[p].type, tokens[q].type);
-			panic("expression wrong");
-		}	
+		printf("%d %d\n", tokens[p].type, tokens[q].type);
+		return false;
 	}
 	else{
 		// 找op，从右往左，如果遇到括号，则忽略括号里面的东西，
@@ -214,35 +251,74 @@ int eval(int p,int q){
 			}		
 		}	
 		int op = -1;
-		for(int i = 0;i<(int)sizeof(array);i++){
+		for(int i = 0;i<ARRLEN(array);i++){
 			if(array[i] != -1){
 				op = array[i];
 				break;
 			}	
 		}
-		int val1 = eval(p,op-1);
-		int val2 = eval(op+1,q);
-		switch(tokens[op].type){
-			case TK_AND: return val1 && val2;break;
-			case TK_EQ: return val1 == val2;break;
-			case TK_NEQ: return val1 != val2;break;
-			case '+': return val1+val2;break;
-			case '-': return val1-val2;break;
-			case '*': return val1*val2;break;
-			case '/': return val1/val2;break;
+		if(op == -1) return false;
+		if(!compile(ex, p, op-1) || !compile(ex, op+1, q)) return false;
+		emit(ex, tokens[op].type, 0);
+		return true;
+	}
+}
+
+static word_t read_input(Input *in){
+	return (in->type == TK_REG ? *in->reg : paddr_read(in->addr, 4));
+}
+
+bool expr_update(Expr *ex){
+	bool changed = false;
+	for(int i = 0; i < ex->nr_input; i++){
+		word_t val = read_input(&ex->input[i]);
+		if(val != ex->input[i].val) changed = true;
+		ex->input[i].val = val;
+	}
+	return changed;
+}
+
+word_t expr_run(Expr *ex){
+	int top = 0;
+	word_t *stk = ex->stack;
+	for(int i = 0; i < ex->nr_inst; i++){
+		Inst *in = &ex->inst[i];
+		switch(in->type){
+			case TK_NUM: stk[top++] = in->val; continue;
+			case TK_REG:
+			case TK_DEREF: stk[top++] = ex->input[in->val].val; continue;
+		}
+		word_t val2 = stk[--top], val1 = stk[--top];
+		switch(in->type){
+			case TK_AND: stk[top] = val1 && val2; break;
+			case TK_EQ: stk[top] = val1 == val2; break;
+			case TK_NEQ: stk[top] = val1 != val2; break;
+			case '+': stk[top] = val1+val2; break;
+			case '-': stk[top] = val1-val2; break;
+			case '*': stk[top] = val1*val2; break;
+			//除以-1单独处理, 避免最小负数除以-1溢出触发SIGFPE
+			case '/': stk[top] = (val2 == 0 ? 0 : (sword_t)val2 == -1 ? -val1 : (sword_t)val1/(sword_t)val2); break;
 			default: assert(0);
 		}
+		top++;
 	}
+	return stk[0];
 }
 
+void expr_free(Expr *ex){
+	if(ex == NULL) return;
+	free(ex->inst);
+	free(ex->input);
+	free(ex->stack);
+	free(ex);
+}
 
-word_t expr(char *e, bool *success) {
-  if (!make_token(e)) {
+Expr* expr_compile(char *e, bool *success) {
+  if (!make_token(e) || nr_token == 0) {
     *success = false;
-    return 0;
+    return NULL;
   }
 
-  /* TODO: Insert codes to evaluate the expression. */
 	//DEREF (* the address of memory) 
 	for(int i = 0;i<nr_token;i++){
 		if(tokens[i].type == '*' && (i == 0 || tokens[i-1].type == '(')){
@@ -251,6 +327,26 @@ word_t expr(char *e, bool *success) {
 		}
 	}
 
-	word_t res = (word_t)eval(0,nr_token-1);
+	Expr *ex = malloc(sizeof(Expr));
+	ex->nr_inst = ex->nr_input = 0;
+	ex->inst = malloc(sizeof(Inst) * nr_token);
+	ex->input = malloc(sizeof(Input) * nr_token);
+	ex->stack = malloc(sizeof(word_t) * nr_token);
+	assert(ex->inst && ex->input && ex->stack);
+	if(!compile(ex, 0, nr_token-1)){
+		expr_free(ex);
+		*success = false;
+		return NULL;
+	}
+	expr_update(ex);
+	*success = true;
+	return ex;
+}
+
+word_t expr(char *e, bool *success) {
+	Expr *ex = expr_compile(e, success);
+	if (ex == NULL) return 0;
+	word_t res = expr_run(ex);
+	expr_free(ex);
 	return res;
 }
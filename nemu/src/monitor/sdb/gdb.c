@@ -0,0 +1,455 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* A stub of the GDB remote serial protocol. NEMU waits for gdb on PORT of
+ * localhost (or on a Unix socket when the argument is not a number):
+ *   (gdb) target remote :PORT
+ * Registers are the difftest register block (GPRs + pc), memory is pmem seen
+ * through the MMU, Z0/Z1 use the breakpoint bitmap and Z2 uses the location
+ * watchpoints, so no instruction in the guest memory is ever patched.
+ */
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <difftest-def.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include "sdb.h"
+
+#define PACKET_SIZE 0x4000
+#define RUN_CHUNK (1 << 20) // instructions to run between two checks for ^C
+
+#if defined(CONFIG_ISA_riscv)
+#define GDB_ARCH MUXDEF(CONFIG_RV64, "riscv:rv64", "riscv:rv32")
+#elif defined(CONFIG_ISA_x86)
+#define GDB_ARCH "i386"
+#elif defined(CONFIG_ISA_mips32)
+#define GDB_ARCH "mips"
+#elif defined(CONFIG_ISA_loongarch32r)
+#define GDB_ARCH "loongarch32"
+#endif
+
+static const char target_xml[] =
+  "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+  "<target><architecture>" GDB_ARCH "</architecture></target>";
+
+static int fd = -1;
+static bool no_ack = false;
+static char rbuf[4096];
+static int rlen = 0, rpos = 0;
+static char pkt[PACKET_SIZE + 1];  // the received packet, unescaped
+static char reply[PACKET_SIZE + 1];
+
+// Z2 watchpoints are set on physical addresses, the virtual ones gdb gave
+// are kept to be reported when they are hit
+#define NR_WATCH 16
+typedef struct { vaddr_t va; paddr_t pa; word_t len; } GdbWatch;
+static GdbWatch watch_tab[NR_WATCH];
+static int nr_watch = 0;
+
+static int conn_getc() {
+  if (rpos == rlen) {
+    rlen = read(fd, rbuf, sizeof(rbuf));
+    rpos = 0;
+    if (rlen <= 0) { rlen = 0; return -1; }
+  }
+  return (uint8_t)rbuf[rpos ++];
+}
+
+static bool conn_write(const char *buf, int len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0) return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+static int hexval(int c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static char* put_hex(char *p, const uint8_t *data, int len) {
+  for (int i = 0; i < len; i ++) p += sprintf(p, "%02x", data[i]);
+  return p;
+}
+
+static bool get_hex(const char *s, uint8_t *data, int len) {
+  for (int i = 0; i < len; i ++) {
+    int h = hexval(s[i * 2]), l = (h < 0 ? -1 : hexval(s[i * 2 + 1]));
+    if (l < 0) return false;
+    data[i] = h * 16 + l;
+  }
+  return true;
+}
+
+// receive a packet into pkt[], return its length or -1 when gdb is gone
+static int recv_packet() {
+  while (true) {
+    int c;
+    // skip acks and ^C which arrives while the guest is already stopped
+    while ((c = conn_getc()) != '$') { if (c < 0) return -1; }
+    int len = 0;
+    uint8_t sum = 0;
+    bool esc = false;
+    while ((c = conn_getc()) != '#') {
+      if (c < 0) return -1;
+      sum += c;
+      if (esc) { c ^= 0x20; esc = false; }
+      else if (c == '}') { esc = true; continue; }
+      if (len < PACKET_SIZE) pkt[len ++] = c;
+    }
+    int h = conn_getc(), l = conn_getc();
+    if (l < 0) return -1;
+    pkt[len] = '\0';
+    if (no_ack) return len;
+    if (hexval(h) * 16 + hexval(l) == sum) { conn_write("+", 1); return len; }
+    conn_write("-", 1);
+  }
+}
+
+static bool send_packet(const char *data, int len) {
+  static char buf[sizeof(reply) + 4];
+  uint8_t sum = 0;
+  buf[0] = '$';
+  for (int i = 0; i < len; i ++) { buf[i + 1] = data[i]; sum += data[i]; }
+  sprintf(buf + len + 1, "#%02x", sum);
+  while (true) {
+    if (!conn_write(buf, len + 4)) return false;
+    if (no_ack) return true;
+    int c;
+    do { c = conn_getc(); } while (c >= 0 && c != '+' && c != '-');
+    if (c != '-') return c == '+';
+  }
+}
+
+static bool send_str(const char *s) {
+  return send_packet(s, strlen(s));
+}
+
+// check whether gdb sends ^C, without blocking
+static bool interrupted() {
+  if (rpos == rlen) {
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    if (poll(&p, 1, 0) <= 0) return false;
+    if (conn_getc() < 0) return true;
+    rpos --;
+  }
+  if (rbuf[rpos] != 0x03) return false;
+  rpos ++;
+  return true;
+}
+
+// translate a virtual address for the debugger, only pmem is accessible
+static bool translate(vaddr_t vaddr, int type, paddr_t *paddr) {
+  paddr_t pa = vaddr;
+  switch (isa_mmu_check(vaddr, 1, type)) {
+    case MMU_DIRECT: break;
+    case MMU_TRANSLATE: {
+      paddr_t pg = isa_mmu_translate(vaddr, 1, type);
+      if ((pg & PAGE_MASK) != MEM_RET_OK) return false;
+      pa = (pg & ~(paddr_t)PAGE_MASK) | (vaddr & PAGE_MASK);
+      break;
+    }
+    default: return false;
+  }
+  *paddr = pa;
+  return in_pmem(pa);
+}
+
+// return the number of bytes read
+static int mem_read(vaddr_t addr, uint8_t *buf, int len) {
+  paddr_t pa;
+  int i;
+  for (i = 0; i < len && translate(addr + i, MEM_TYPE_READ, &pa); i ++) {
+    buf[i] = *guest_to_host(pa);
+  }
+  return i;
+}
+
+// write through paddr_write() so that the code and watch hooks see the store
+static bool mem_write(vaddr_t addr, const uint8_t *buf, int len) {
+  paddr_t pa;
+  for (int i = 0; i < len; i ++) {
+    if (!translate(addr + i, MEM_TYPE_WRITE, &pa)) return false;
+    paddr_write(pa, 1, buf[i]);
+  }
+  return true;
+}
+
+// the virtual address of the watched data written by the store at `pa`,
+// which may start before the watched range
+static vaddr_t watch_vaddr(paddr_t pa) {
+  for (int i = 0; i < nr_watch; i ++) {
+    paddr_t start = watch_tab[i].pa, last = start + watch_tab[i].len - 1;
+    if (pa > last || pa + sizeof(word_t) - 1 < start) continue;
+    return watch_tab[i].va + (pa > start ? pa - start : 0);
+  }
+  return pa;
+}
+
+static bool send_stop(int sig, bool watch, vaddr_t addr) {
+  char buf[64];
+  switch (nemu_state.state) {
+    case NEMU_END: snprintf(buf, sizeof(buf), "W%02x", nemu_state.halt_ret & 0xff); break;
+    case NEMU_ABORT: snprintf(buf, sizeof(buf), "X%02x", SIGABRT); break;
+    default:
+      if (watch) snprintf(buf, sizeof(buf), "T%02xwatch:%" PRIx64 ";", sig, (uint64_t)addr);
+      else snprintf(buf, sizeof(buf), "T%02x", sig);
+  }
+  return send_str(buf);
+}
+
+static bool resume(bool step) {
+  extern uint64_t g_nr_guest_inst;
+  int sig = SIGTRAP;
+  bool watch = false;
+  paddr_t addr = 0;
+  bp_last_hit();
+  wp_last_hit(&addr); // drop the hits before this run
+  if (nemu_state.state == NEMU_END || nemu_state.state == NEMU_ABORT) {
+    return send_stop(sig, false, 0);
+  }
+  if (step) {
+    cpu_exec(1);
+    watch = wp_last_hit(&addr);
+  } else {
+    while (true) {
+      uint64_t start = g_nr_guest_inst;
+      cpu_exec(RUN_CHUNK);
+      watch = wp_last_hit(&addr);
+      if (bp_last_hit() || watch || nemu_state.state != NEMU_STOP ||
+          g_nr_guest_inst - start < RUN_CHUNK) break;
+      if (interrupted()) { sig = SIGINT; break; }
+    }
+  }
+  return send_stop(sig, watch, watch ? watch_vaddr(addr) : 0);
+}
+
+static void reply_regs() {
+  char *p = put_hex(reply, (uint8_t *)&cpu, DIFFTEST_REG_SIZE);
+  send_packet(reply, p - reply);
+}
+
+static void reply_reg(int n) {
+  if ((n + 1) * sizeof(word_t) > DIFFTEST_REG_SIZE) {
+    // not provided by NEMU, report it as unavailable
+    memset(reply, 'x', sizeof(word_t) * 2);
+    send_packet(reply, sizeof(word_t) * 2);
+    return;
+  }
+  char *p = put_hex(reply, (uint8_t *)&cpu + n * sizeof(word_t), sizeof(word_t));
+  send_packet(reply, p - reply);
+}
+
+static void reply_xfer(const char *annex) {
+  char *end = NULL;
+  unsigned long off = strtoul(annex, &end, 16);
+  unsigned long len = strtoul(end + 1, NULL, 16);
+  unsigned long total = sizeof(target_xml) - 1;
+  if (off >= total) { send_str("l"); return; }
+  if (len > PACKET_SIZE - 1) len = PACKET_SIZE - 1;
+  if (len > total - off) len = total - off;
+  reply[0] = (off + len < total ? 'm' : 'l');
+  memcpy(reply + 1, target_xml + off, len);
+  send_packet(reply, len + 1);
+}
+
+// Z/z packets: "Z TYPE,ADDR,KIND"
+static void reply_point(bool insert) {
+  char *end = NULL;
+  int type = strtol(pkt + 1, &end, 16);
+  vaddr_t addr = strtoull(end + 1, &end, 16);
+  word_t kind = strtoull(end + 1, NULL, 16);
+  bool ok = false;
+  paddr_t pa;
+  switch (type) {
+    case 0: case 1: ok = (insert ? bp_insert(addr) : bp_remove(addr)); break;
+    case 2:
+      if (!translate(addr, MEM_TYPE_WRITE, &pa)) break;
+      if (insert) {
+        ok = (nr_watch < NR_WATCH && wp_watch(pa, kind));
+        if (ok) watch_tab[nr_watch ++] = (GdbWatch) { .va = addr, .pa = pa, .len = kind };
+        break;
+      }
+      ok = wp_unwatch(pa, kind);
+      for (int i = 0; ok && i < nr_watch; i ++) {
+        if (watch_tab[i].pa == pa && watch_tab[i].len == kind) { watch_tab[i] = watch_tab[-- nr_watch]; break; }
+      }
+      break;
+    default: send_str(""); return; // read and access watchpoints are not supported
+  }
+  send_str(ok ? "OK" : "E01");
+}
+
+static void reply_mem(bool binary) {
+  char *end = NULL;
+  vaddr_t addr = strtoull(pkt + 1, &end, 16);
+  int len = strtoul(end + 1, &end, 16);
+  if (pkt[0] == 'm') {
+    uint8_t buf[PACKET_SIZE / 2];
+    if (len > sizeof(buf)) len = sizeof(buf);
+    int n = mem_read(addr, buf, len);
+    if (n == 0 && len != 0) { send_str("E01"); return; }
+    char *p = put_hex(reply, buf, n);
+    send_packet(reply, p - reply);
+    return;
+  }
+  if (*end != ':') { send_str("E01"); return; }
+  uint8_t buf[PACKET_SIZE];
+  const uint8_t *data = (const uint8_t *)end + 1;
+  if (!binary) {
+    if (len > sizeof(buf) || !get_hex(end + 1, buf, len)) { send_str("E01"); return; }
+    data = buf;
+  } else if (data + len > (uint8_t *)pkt + PACKET_SIZE) {
+    send_str("E01");
+    return;
+  }
+  send_str(mem_write(addr, data, len) ? "OK" : "E01");
+}
+
+// handle the packet in pkt[], return false when the session ends
+static bool handle(int len) {
+  uint8_t buf[DIFFTEST_REG_SIZE];
+  char *end = NULL;
+  switch (pkt[0]) {
+    case '?': send_stop(SIGTRAP, false, 0); return true;
+    case 'g': reply_regs(); return true;
+    case 'G':
+      if (!get_hex(pkt + 1, buf, DIFFTEST_REG_SIZE)) { send_str("E01"); return true; }
+      memcpy(&cpu, buf, DIFFTEST_REG_SIZE);
+      send_str("OK");
+      return true;
+    case 'p': reply_reg(strtol(pkt + 1, NULL, 16)); return true;
+    case 'P': {
+      int n = strtol(pkt + 1, &end, 16);
+      if ((n + 1) * sizeof(word_t) > DIFFTEST_REG_SIZE || !get_hex(end + 1, buf, sizeof(word_t))) {
+        send_str("E01");
+        return true;
+      }
+      memcpy((uint8_t *)&cpu + n * sizeof(word_t), buf, sizeof(word_t));
+      send_str("OK");
+      return true;
+    }
+    case 'm': case 'M': reply_mem(false); return true;
+    case 'X': reply_mem(true); return true;
+    case 'c': case 's':
+      if (pkt[1] != '\0') cpu.pc = strtoull(pkt + 1, NULL, 16);
+      return resume(pkt[0] == 's');
+    case 'Z': reply_point(true); return true;
+    case 'z': reply_point(false); return true;
+    case 'H': case 'T': send_str("OK"); return true;
+    case 'k': nemu_state.state = NEMU_QUIT; return false;
+    case 'D':
+      send_str("OK");
+      if (nemu_state.state == NEMU_STOP) cpu_exec(-1);
+      return false;
+  }
+
+  if (strncmp(pkt, "qSupported", 10) == 0) {
+    snprintf(reply, sizeof(reply), "PacketSize=%x;QStartNoAckMode+;qXfer:features:read+;"
+        "vContSupported+", PACKET_SIZE);
+    send_str(reply);
+  } else if (strcmp(pkt, "QStartNoAckMode") == 0) {
+    send_str("OK");
+    no_ack = true;
+  } else if (strncmp(pkt, "qXfer:features:read:target.xml:", 31) == 0) {
+    reply_xfer(pkt + 31);
+  } else if (strcmp(pkt, "qC") == 0) {
+    send_str("QC1");
+  } else if (strcmp(pkt, "qfThreadInfo") == 0) {
+    send_str("m1");
+  } else if (strcmp(pkt, "qsThreadInfo") == 0) {
+    send_str("l");
+  } else if (strncmp(pkt, "qAttached", 9) == 0) {
+    send_str("1");
+  } else if (strcmp(pkt, "vCont?") == 0) {
+    send_str("vCont;c;C;s;S");
+  } else if (strncmp(pkt, "vCont;", 6) == 0) {
+    // there is only one thread, so the first action decides
+    char action = pkt[6];
+    if (action == 'c' || action == 'C') return resume(false);
+    if (action == 's' || action == 'S') return resume(true);
+    send_str("E01");
+  } else if (strncmp(pkt, "vKill", 5) == 0) {
+    send_str("OK");
+    nemu_state.state = NEMU_QUIT;
+    return false;
+  } else {
+    send_str("");
+  }
+  return true;
+}
+
+static int gdb_accept(const char *target) {
+  bool is_port = target[strspn(target, "0123456789")] == '\0';
+  int s = -1, ret = -1;
+  if (is_port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(atoi(target)),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    int on = 1;
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    Assert(s >= 0, "fail to create the socket for gdb");
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    ret = bind(s, (struct sockaddr *)&addr, sizeof(addr));
+  } else {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    Assert(strlen(target) < sizeof(addr.sun_path), "socket path %s is too long", target);
+    strcpy(addr.sun_path, target);
+    unlink(target);
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    Assert(s >= 0, "fail to create the socket for gdb");
+    ret = bind(s, (struct sockaddr *)&addr, sizeof(addr));
+  }
+  Assert(ret == 0 && listen(s, 1) == 0, "fail to listen on %s", target);
+  Log("Waiting for gdb on %s%s", (is_port ? "localhost:" : ""), target);
+  int c = accept(s, NULL, NULL);
+  Assert(c >= 0, "fail to accept the connection from gdb");
+  close(s);
+  if (is_port) {
+    int on = 1;
+    setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  } else {
+    unlink(target);
+  }
+  return c;
+}
+
+void gdb_mainloop(const char *target) {
+  signal(SIGPIPE, SIG_IGN);
+  fd = gdb_accept(target);
+  while (true) {
+    int len = recv_packet();
+    if (len < 0) {
+      // gdb is gone without detaching
+      if (nemu_state.state == NEMU_STOP) nemu_state.state = NEMU_QUIT;
+      break;
+    }
+    if (!handle(len)) break;
+  }
+  close(fd);
+  fd = -1;
+}
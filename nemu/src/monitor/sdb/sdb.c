@@ -15,11 +15,16 @@
 
 #include <isa.h>
 #include <cpu/cpu.h>
+#include <utils.h>
+#include <memory/mtrace.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "sdb.h"
 
 static int is_batch_mode = false;
+static char *gdb_target = NULL;
+static char *save_file = NULL;
+static uint64_t save_at = 0;
 
 void init_regex();
 void init_wp_pool();
@@ -48,7 +53,7 @@ static char* rl_gets() {
 }
 
 static int cmd_c(char *args) {
-  cpu_exec(-1);
+  snapshot_exec(-1);
   return 0;
 }
 
@@ -73,7 +78,11 @@ static int cmd_info(char *args){
 		isa_reg_display();
 	}else if(strcmp(arg,"w") == 0){
 		watchpoint_display();	
-	}else panic("info r/w");	
+	}else if(strcmp(arg,"s") == 0){
+		snapshot_display();
+	}else if(strcmp(arg,"b") == 0){
+		bp_display();
+	}else panic("info r/w/s/b");	
 	return 0;
 }
 
@@ -101,6 +110,15 @@ static int cmd_p(char *args){
 
 static int cmd_w(char *args){
 	char *expr = strtok(NULL, " ");
+	if(expr != NULL && strcmp(expr, "-l") == 0){    //w -l ADDR LEN 监视对一段内存的写
+		char *addr = strtok(NULL, " ");
+		char *len = strtok(NULL, " ");
+		char buf[64];
+		if(addr == NULL || len == NULL){ printf("w -l ADDR LEN\n"); return 0; }
+		snprintf(buf, sizeof(buf), "-l %s %s", addr, len);
+		new_wp(buf);
+		return 0;
+	}
 	new_wp(expr);
 	return 0;
 }
@@ -113,6 +131,113 @@ static int cmd_d(char *args){
 	return 0;
 }
 
+static int cmd_b(char *args){
+	char *arg = strtok(NULL, " ");
+	if(arg == NULL){ printf("b ADDR|SYMBOL [if EXPR]\n"); return 0; }
+	char *end = NULL;
+	vaddr_t pc = strtoull(arg, &end, 0);
+	if(*end != '\0'){              //不是数字时按函数名查找
+		const Symbol *sym = symbol_find(arg);
+		if(sym == NULL){ printf("No symbol %s\n", arg); return 0; }
+		pc = sym->addr;
+	}
+	char *cond = strtok(NULL, "");  //剩下的部分是条件
+	if(cond != NULL){
+		while(*cond == ' ') cond++;
+		if(strncmp(cond, "if ", 3) != 0){ printf("b ADDR|SYMBOL [if EXPR]\n"); return 0; }
+		cond += 3;
+	}
+	new_bp(pc, cond);
+	return 0;
+}
+
+static int cmd_bd(char *args){
+	char *arg = strtok(NULL, " ");
+	int NO = -1;
+	if(arg == NULL || sscanf(arg, "%d", &NO) != 1){ printf("bd N\n"); return 0; }
+	free_bp(NO);
+	return 0;
+}
+
+static int cmd_ignore(char *args){
+	char *arg = strtok(NULL, " ");
+	char *n = strtok(NULL, " ");
+	int NO = -1;
+	uint64_t count = 0;
+	if(arg == NULL || n == NULL || sscanf(arg, "%d", &NO) != 1 || sscanf(n, "%" SCNu64, &count) != 1){
+		printf("ignore N COUNT\n");
+		return 0;
+	}
+	bp_set_ignore(NO, count);
+	return 0;
+}
+
+static int cmd_save(char *args) {
+	char *file = strtok(NULL, " ");
+	if (file == NULL) { printf("save FILE\n"); return 0; }
+	checkpoint_save(file);
+	return 0;
+}
+
+static int cmd_load(char *args) {
+	char *file = strtok(NULL, " ");
+	if (file == NULL) { printf("load FILE\n"); return 0; }
+	checkpoint_load(file);
+	return 0;
+}
+
+static int cmd_snapshot(char *args) {
+	char *arg = strtok(NULL, " ");
+	if (arg == NULL) { snapshot_take(); return 0; }
+	if (strcmp(arg, "off") == 0) { snapshot_set_interval(0); return 0; }
+	char *n = strtok(NULL, " ");
+	uint64_t m = 0;
+	if (strcmp(arg, "every") != 0 || n == NULL || sscanf(n, "%" SCNu64, &m) != 1 || m == 0) {
+		printf("snapshot [every N | off]\n");
+		return 0;
+	}
+	snapshot_set_interval(m * 1000000);
+	return 0;
+}
+
+static int cmd_rewind(char *args) {
+	char *arg = strtok(NULL, " ");
+	int id = -1;
+	if (arg == NULL || sscanf(arg, "%d", &id) != 1) { printf("rewind ID\n"); return 0; }
+	snapshot_rewind(id);
+	return 0;
+}
+
+static int cmd_rsi(char *args) {
+	char *arg = strtok(NULL, " ");
+	uint64_t step = 1;
+	if (arg != NULL) sscanf(arg, "%" SCNu64, &step);
+	reverse_step(step);
+	return 0;
+}
+
+static int cmd_rc(char *args) {
+	reverse_continue();
+	return 0;
+}
+
+#ifdef CONFIG_MTRACE
+static int cmd_mtrace(char *args) {
+	char *arg = strtok(NULL, " ");
+	if (arg == NULL) { mtrace_display(); return 0; }
+	char *n = strtok(NULL, " ");
+	if (strcmp(arg, "d") == 0) {
+		int id = -1;
+		if (n == NULL || sscanf(n, "%d", &id) != 1 || !mtrace_del(id)) printf("mtrace d N\n");
+		return 0;
+	}
+	paddr_t addr = strtoull(arg, NULL, 0);
+	uint64_t len = (n ? strtoull(n, NULL, 0) : 0);
+	if (len == 0 || !mtrace_add(addr, addr + len - 1)) printf("mtrace ADDR LEN\n");
+	return 0;
+}
+#endif
+
 static int cmd_help(char *args);
 
 static struct {
@@ -124,11 +249,23 @@ static struct {
   { "c", "Continue the execution of the program", cmd_c },
   { "q", "Exit NEMU", cmd_q },
 	{ "si", "si [N]", cmd_si },
-	{ "info", "info r/w 打印寄存器状态/打印监视点信息", cmd_info },
+	{ "info", "info r/w/b 打印寄存器状态/打印监视点信息/打印断点信息", cmd_info },
 	{ "x", "x [N] EXPER 求出表达式EXPR的值, 将结果作为起始内存地址, 以十六进制形式输出连续的N个4字节", cmd_x },
 	{ "p", "p EXPR 求出表达式EXPR的值", cmd_p },
-	{ "w", "w EXPR 当表达式EXPR的值发生变化时, 暂停程序执行", cmd_w },
+	{ "w", "w EXPR | w -l ADDR LEN 当表达式EXPR的值发生变化时/有store写[ADDR, ADDR+LEN)时, 暂停程序执行", cmd_w },
 	{ "d", "d N 删除序号为N的监视点", cmd_d },
+	{ "b", "b ADDR|SYMBOL [if EXPR] 在地址ADDR或函数SYMBOL处设置断点, 有条件时只在EXPR非0时暂停", cmd_b },
+	{ "bd", "bd N 删除序号为N的断点", cmd_bd },
+	{ "ignore", "ignore N COUNT 忽略断点N接下来的COUNT次命中", cmd_ignore },
+	{ "save", "save FILE 保存检查点(CPU, 内存和设备状态)到FILE", cmd_save },
+	{ "load", "load FILE 从FILE恢复检查点", cmd_load },
+	{ "snapshot", "snapshot [every N | off] 用fork保存快照/每执行N百万条指令保存一次快照/停止定期快照, info s 列出快照", cmd_snapshot },
+	{ "rewind", "rewind ID 回到编号为ID的快照继续执行", cmd_rewind },
+	{ "rsi", "rsi [N] 反向执行N条指令(reverse-stepi), 从之前最近的快照重放", cmd_rsi },
+	{ "rc", "rc 反向执行到监视点的值最后一次发生变化或断点最后一次命中处(reverse-continue)", cmd_rc },
+#ifdef CONFIG_MTRACE
+	{ "mtrace", "mtrace [ADDR LEN | d N] 记录对[ADDR, ADDR+LEN)的访存/删除编号为N的范围, 无参数时列出所有范围", cmd_mtrace },
+#endif
   /* TODO: Add more commands */
 
 };
@@ -162,8 +299,28 @@ void sdb_set_batch_mode() {
   is_batch_mode = true;
 }
 
+// serve gdb on `target` (a port of localhost or a Unix socket) instead of the command line
+void sdb_set_gdb(char *target) {
+  gdb_target = target;
+}
+
+// save a checkpoint once `nr_inst` instructions are executed
+void sdb_set_save(char *file, uint64_t nr_inst) {
+  save_file = file;
+  save_at = nr_inst;
+}
+
 void sdb_mainloop() {
   //sdb_set_batch_mode();
+  if (save_file != NULL) {
+    extern uint64_t g_nr_guest_inst;
+    if (save_at > g_nr_guest_inst) cpu_exec(save_at - g_nr_guest_inst);
+    Assert(checkpoint_save(save_file), "fail to save %s", save_file);
+  }
+  if (gdb_target != NULL) {
+    gdb_mainloop(gdb_target);
+    return;
+  }
   if (is_batch_mode) {
     cmd_c(NULL);
     return;
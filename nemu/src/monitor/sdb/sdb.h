@@ -20,4 +20,38 @@
 
 word_t expr(char *e, bool *success);
 
+typedef struct Expr Expr;
+Expr* expr_compile(char *e, bool *success);
+bool expr_update(Expr *ex);
+word_t expr_run(Expr *ex);
+void expr_free(Expr *ex);
+
+void traver_trace_diff();
+bool wp_update();
+int wp_save(char *buf, int size);
+void wp_restore(const char *buf, int len);
+bool wp_watch(paddr_t addr, word_t len);
+bool wp_unwatch(paddr_t addr, word_t len);
+bool wp_last_hit(paddr_t *addr);
+
+void new_bp(vaddr_t pc, char *cond);
+void free_bp(int NO);
+void bp_set_ignore(int NO, uint64_t n);
+void bp_display();
+int bp_save(char *buf, int size);
+void bp_restore(const char *buf, int len);
+bool bp_insert(vaddr_t pc);
+bool bp_remove(vaddr_t pc);
+bool bp_last_hit();
+
+void gdb_mainloop(const char *target);
+
+void snapshot_take();
+void snapshot_rewind(int id);
+void snapshot_set_interval(uint64_t n);
+void snapshot_display();
+void snapshot_exec(uint64_t n);
+void reverse_step(uint64_t n);
+void reverse_continue();
+
 #endif
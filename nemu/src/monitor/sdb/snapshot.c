@@ -0,0 +1,368 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <utils.h>
+#include <memory/mtrace.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "sdb.h"
+
+/* Snapshots are forked copies of NEMU parked in a blocking read(), so the
+ * kernel shares the unchanged pages (mostly pmem) among them by copy on
+ * write. Rewinding to a snapshot sends it a request, and it forks once
+ * more. The new child serves the request and continues as the active
+ * NEMU, while the snapshot stays parked for later rewinds. The process
+ * which rewinds kills the snapshots taken after the chosen one, which the
+ * new NEMU does not know, and exits as soon as it has no children left,
+ * as they would be killed with it. Parked and retired processes ignore
+ * SIGCHLD, so nothing is left as a zombie.
+ *
+ * Every process is killed when its parent exits (PR_SET_PDEATHSIG), so
+ * the whole tree goes away with the first NEMU. That one waits for the
+ * active NEMU to report its exit status through `session_pipe` and then
+ * exits with it. A snapshot only knows the snapshots taken before it, as
+ * they are in the timeline it belongs to.
+ *
+ * Reverse execution is built on them: as the execution is deterministic,
+ * the state at any earlier instruction is reached by rewinding to the
+ * last snapshot before it and replaying quietly with cpu_replay().
+ * Reverse-continue replays with cpu_replay_events() instead, which runs at
+ * full speed from one watchpoint change or breakpoint hit to the next.
+ */
+#define MAX_SNAPSHOT 32
+#define STATE_SIZE 8192 // watchpoints and breakpoints sent with a request
+
+typedef struct {
+  int id;
+  pid_t pid;
+  int cmd_fd;    // requests are written to it
+  bool ancestor; // the active process is forked from it, do not kill it
+  uint64_t nr_inst;
+  vaddr_t pc;
+} Snapshot;
+
+enum {
+  REQ_REWIND, // replay up to `target`
+  REQ_WATCH,  // replay up to `target`, and report the watchpoints changed by the last instruction
+  REQ_SEARCH, // find the last watchpoint change or breakpoint hit before `target`
+};
+
+// followed by `wp_len` bytes of the watchpoints and `bp_len` bytes of
+// the breakpoints, see wp_save() and bp_save()
+typedef struct {
+  int type;
+  int wp_len, bp_len;
+  uint64_t target;
+  uint64_t origin; // where the reverse execution starts
+} Request;
+
+static Snapshot snapshot[MAX_SNAPSHOT] = {};
+static int nr_snapshot = 0;
+static int next_id = 0;
+static uint64_t interval = 0, next_snapshot = 0;
+static pid_t root_pid = 0;
+static int session_pipe[2] = { -1, -1 };
+static bool resumed = false; // just rewound, stop the running command
+static Snapshot diff_snapshot = {}; // the latest snapshot for difftest
+
+extern uint64_t g_nr_guest_inst;
+int is_exit_status_bad();
+
+static void report_exit() {
+  if (getpid() == root_pid) return;
+  uint8_t status = is_exit_status_bad();
+  __attribute__((unused)) ssize_t ret = write(session_pipe[1], &status, 1);
+}
+
+static void init_session() {
+  if (root_pid != 0) return;
+  root_pid = getpid();
+  Assert(pipe(session_pipe) == 0, "fail to create the pipe for snapshots");
+  atexit(report_exit);
+}
+
+/* The process handing over the terminal kills the snapshots after the
+ * first `nr_keep` ones, and exits when its last child is gone. The first
+ * NEMU waits for the exit status instead.
+ */
+static void __attribute__((noreturn)) retire(int nr_keep) {
+  log_flush();
+  IFDEF(CONFIG_MTRACE, mtrace_flush());
+  signal(SIGCHLD, SIG_IGN);
+  for (int i = nr_keep; i < nr_snapshot; i ++) kill(snapshot[i].pid, SIGKILL);
+  if (getpid() == root_pid) {
+    close(session_pipe[1]);
+    uint8_t status = 1;
+    __attribute__((unused)) ssize_t ret = read(session_pipe[0], &status, 1);
+    _exit(status);
+  }
+  // with SIGCHLD ignored, wait() returns when all children have exited
+  while (wait(NULL) != -1 || errno == EINTR);
+  _exit(0);
+}
+
+static void forget(int i) {
+  memmove(&snapshot[i], &snapshot[i + 1], sizeof(snapshot[0]) * (nr_snapshot - i - 1));
+  nr_snapshot --;
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+  for (size_t n = 0; n < len; ) {
+    ssize_t ret = read(fd, (char *)buf + n, len - n);
+    if (ret <= 0) return false;
+    n += ret;
+  }
+  return true;
+}
+
+static void send(Snapshot *s, int type, uint64_t target, uint64_t origin) {
+  static char buf[STATE_SIZE];
+  Request req = { .type = type, .wp_len = wp_save(buf, sizeof(buf) / 2), .target = target, .origin = origin };
+  req.bp_len = bp_save(buf + req.wp_len, sizeof(buf) / 2);
+  int len = req.wp_len + req.bp_len;
+  fflush(stdout);
+  if (write(s->cmd_fd, &req, sizeof(req)) != sizeof(req) ||
+      write(s->cmd_fd, buf, len) != len) {
+    perror("rewind");
+    return;
+  }
+  retire(s - snapshot + 1);
+}
+
+// the last snapshot taken at or before `nr_inst`
+static Snapshot* snapshot_before(uint64_t nr_inst) {
+  for (int i = nr_snapshot - 1; i >= 0; i --) {
+    if (snapshot[i].nr_inst <= nr_inst) return &snapshot[i];
+  }
+  return NULL;
+}
+
+// the watchpoints and breakpoints sent with the request
+static void restore(Request *req, const char *state) {
+  wp_restore(state, req->wp_len);
+  bp_restore(state + req->wp_len, req->bp_len);
+}
+
+static void search(Snapshot *s, Request *req, const char *state) {
+  // stop at each watchpoint change or breakpoint hit
+  uint64_t end = req->target, origin = req->origin, last = 0;
+  while (g_nr_guest_inst < end) {
+    bool hit = cpu_replay_events(end - g_nr_guest_inst);
+    if (nemu_state.state != NEMU_STOP) break;
+    // the hit made by the instruction just before `origin` is the current one
+    if (hit && g_nr_guest_inst < origin) last = g_nr_guest_inst;
+  }
+  // the hit counts of breakpoints are changed by the replay
+  restore(req, state);
+  if (last != 0) send(s, REQ_WATCH, last, origin);
+  Snapshot *prev = (s->nr_inst > 0 ? snapshot_before(s->nr_inst - 1) : NULL);
+  if (prev != NULL) send(prev, REQ_SEARCH, s->nr_inst, origin);
+  printf("No change of the watchpoints or hit of the breakpoints since snapshot %d\n", s->id);
+  // go back to where we start
+  if (nemu_state.state == NEMU_STOP) cpu_replay(origin - g_nr_guest_inst);
+  restore(req, state);
+}
+
+// serve the request in the resumed copy of snapshot `s`
+static void serve(Snapshot *s, Request *req, const char *state) {
+  resumed = true;
+  restore(req, state);
+  if (interval != 0) next_snapshot = s->nr_inst + interval;
+  switch (req->type) {
+    case REQ_SEARCH: search(s, req, state); break;
+    case REQ_WATCH:
+      // the last instruction is executed normally to report what it hits,
+      // a breakpoint hit in reverse is counted like in gdb
+      cpu_replay(req->target - 1 - g_nr_guest_inst);
+      wp_update();
+      cpu_exec(1);
+      break;
+    default: cpu_replay(req->target - g_nr_guest_inst); break;
+  }
+  if (interval != 0) {
+    while (next_snapshot <= g_nr_guest_inst) next_snapshot += interval;
+  }
+  printf("Rewound to %" PRIu64 " instructions (snapshot %d), pc = " FMT_WORD "\n",
+      g_nr_guest_inst, s->id, cpu.pc);
+}
+
+// Wait for requests in a snapshot. Return in the child which
+// continues as the active NEMU.
+static void park(int cmd_fd, Request *req, char *wp) {
+  // the resumed copies exit by themselves when they retire
+  signal(SIGCHLD, SIG_IGN);
+  while (read_all(cmd_fd, req, sizeof(*req)) && read_all(cmd_fd, wp, req->wp_len + req->bp_len)) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      signal(SIGCHLD, SIG_DFL);
+      return;
+    }
+  }
+  _exit(0);
+}
+
+void snapshot_take() {
+  resumed = false;
+  init_session();
+  if (nr_snapshot == MAX_SNAPSHOT) {
+    // drop the oldest snapshot which is not an ancestor
+    int i;
+    for (i = 0; i < nr_snapshot && snapshot[i].ancestor; i ++);
+    if (i == nr_snapshot) { printf("Too many snapshots\n"); return; }
+    kill(snapshot[i].pid, SIGKILL);
+    close(snapshot[i].cmd_fd);
+    forget(i);
+  }
+
+  int fd[2];
+  if (pipe(fd) != 0) { perror("pipe"); return; }
+  Snapshot *s = &snapshot[nr_snapshot ++];
+  *s = (Snapshot){ .id = next_id ++, .cmd_fd = fd[1], .nr_inst = g_nr_guest_inst, .pc = cpu.pc };
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) { perror("fork"); close(fd[0]); close(fd[1]); nr_snapshot --; return; }
+  if (pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    static Request req;
+    static char wp[STATE_SIZE];
+    park(fd[0], &req, wp);
+    // now in the resumed copy
+    close(fd[0]);
+    s->pid = getppid();
+    s->ancestor = true;
+    serve(s, &req, wp);
+    return;
+  }
+  close(fd[0]);
+  s->pid = pid;
+}
+
+/* Difftest keeps a single snapshot of its own, not listed by `info
+ * snapshot`. It is taken in the middle of an instruction batch, so the
+ * resumed copy just returns here and goes on from the same place.
+ * Return false in the running NEMU, and true in the copy resumed by
+ * snapshot_rewind_diff(), with its `target` in `*target`.
+ */
+bool snapshot_take_diff(uint64_t *target) {
+  init_session();
+  if (diff_snapshot.pid != 0) {
+    kill(diff_snapshot.pid, SIGKILL);
+    waitpid(diff_snapshot.pid, NULL, 0);
+    close(diff_snapshot.cmd_fd);
+    diff_snapshot.pid = 0;
+  }
+  int fd[2];
+  if (pipe(fd) != 0) { perror("pipe"); return false; }
+  fflush(stdout);
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid < 0) { perror("fork"); close(fd[0]); close(fd[1]); return false; }
+  if (pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    // the parent may exit before prctl(), e.g. right at the end of the program
+    if (getppid() != parent) _exit(0);
+    static Request req;
+    static char state[STATE_SIZE];
+    park(fd[0], &req, state);
+    // now in the resumed copy, whose parent is the snapshot
+    close(fd[0]);
+    diff_snapshot = (Snapshot){};
+    *target = req.target;
+    return true;
+  }
+  close(fd[0]);
+  diff_snapshot = (Snapshot){ .pid = pid, .cmd_fd = fd[1], .nr_inst = g_nr_guest_inst, .pc = cpu.pc };
+  return false;
+}
+
+bool snapshot_has_diff() {
+  return diff_snapshot.pid != 0;
+}
+
+void snapshot_rewind_diff(uint64_t target) {
+  Request req = { .type = REQ_REWIND, .target = target };
+  fflush(stdout);
+  if (write(diff_snapshot.cmd_fd, &req, sizeof(req)) != sizeof(req)) {
+    perror("rewind");
+    return;
+  }
+  retire(nr_snapshot);
+}
+
+void snapshot_rewind(int id) {
+  int i;
+  for (i = 0; i < nr_snapshot && snapshot[i].id != id; i ++);
+  if (i == nr_snapshot) { printf("No snapshot %d\n", id); return; }
+  send(&snapshot[i], REQ_REWIND, snapshot[i].nr_inst, g_nr_guest_inst);
+}
+
+void reverse_step(uint64_t n) {
+  if (n > g_nr_guest_inst) n = g_nr_guest_inst;
+  uint64_t target = g_nr_guest_inst - n;
+  Snapshot *s = snapshot_before(target);
+  if (s == NULL) { printf("No snapshot before %" PRIu64 " instructions\n", target); return; }
+  send(s, REQ_REWIND, target, g_nr_guest_inst);
+}
+
+void reverse_continue() {
+  char buf[4096];
+  if (wp_save(buf, sizeof(buf)) == 0 && bp_save(buf, sizeof(buf)) == 0) {
+    printf("No watchpoint or breakpoint\n");
+    return;
+  }
+  Snapshot *s = (g_nr_guest_inst > 0 ? snapshot_before(g_nr_guest_inst - 1) : NULL);
+  if (s == NULL) { printf("No snapshot before %" PRIu64 " instructions\n", g_nr_guest_inst); return; }
+  send(s, REQ_SEARCH, g_nr_guest_inst, g_nr_guest_inst);
+}
+
+void snapshot_set_interval(uint64_t n) {
+  interval = n;
+  next_snapshot = g_nr_guest_inst + n;
+}
+
+void snapshot_display() {
+  if (interval != 0) printf("A snapshot is taken every %" PRIu64 " instructions\n", interval);
+  for (int i = 0; i < nr_snapshot; i ++) {
+    Snapshot *s = &snapshot[i];
+    printf("%-4d inst = %-14" PRIu64 " pc = " FMT_WORD "%s\n",
+        s->id, s->nr_inst, s->pc, (s->ancestor ? " (ancestor)" : ""));
+  }
+}
+
+// run `n` instructions, and take periodic snapshots on the way
+void snapshot_exec(uint64_t n) {
+  while (interval != 0 && n > 0) {
+    uint64_t left = next_snapshot - g_nr_guest_inst;
+    uint64_t step = (n < left ? n : left);
+    uint64_t start = g_nr_guest_inst;
+    cpu_exec(step);
+    n -= g_nr_guest_inst - start;
+    if (g_nr_guest_inst == next_snapshot) {
+      next_snapshot += interval;
+      if (nemu_state.state == NEMU_STOP) snapshot_take();
+      if (resumed) { resumed = false; return; }
+    }
+    // stopped by others, e.g. a watchpoint or the end of the program
+    if (nemu_state.state != NEMU_STOP || g_nr_guest_inst - start < step) return;
+  }
+  if (n > 0) cpu_exec(n);
+}
@@ -13,6 +13,9 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <memory/paddr.h>
 #include "sdb.h"
 
 #define NR_WP 32
@@ -23,13 +26,69 @@ typedef struct watchpoint {
 
   /* TODO: Add more members if necessary */
 	char *expr;
+	Expr *prog;                  //编译后的表达式, 地址监视点(w -l)为NULL
+	paddr_t addr, last;          //地址监视点监视的范围[addr, last]
 	word_t pre_expr_val;
 } WP;
 
 static WP wp_pool[NR_WP] = {};           //定义了监视点结构的池wp_pool
 static WP *head = NULL, *free_ = NULL;        //head用于组织使用中的监视点结构, free_用于组织空闲的监视点结构
+int g_nr_wp = 0;                              //使用中的表达式监视点个数, 为0时不用在每条指令后检查
+static paddr_t hit_addr = 0;                  //最近一次触发地址监视点的写地址
+static bool hit = false;
 
-word_t expr(char *e, bool *success);
+/* 地址监视点的expr是"-l ADDR LEN", 它不在每条指令后求值, 而是把[ADDR, ADDR+LEN)
+ * 所在的页交给paddr_watch(), 只有写这些页的store会调用wp_written().
+ */
+static bool wp_is_loc(const char *e){
+	return strncmp(e, "-l ", 3) == 0;
+}
+
+//按所有地址监视点重新设置被监视的页
+static void update_watch(){
+	paddr_unwatch_all();
+	for(WP *tmp = head; tmp != NULL; tmp = tmp->next){
+		if(tmp->prog == NULL) paddr_watch(tmp->addr, tmp->last - tmp->addr + 1);
+	}
+}
+
+static void wp_written(paddr_t addr, int len, word_t old, word_t data){
+	if(g_replay) return;                     //重放时由调用者自己检查
+	if(len < sizeof(word_t)){
+		old &= (1ull << (len * 8)) - 1;
+		data &= (1ull << (len * 8)) - 1;
+	}
+	for(WP *tmp = head; tmp != NULL; tmp = tmp->next){
+		if(tmp->prog != NULL || addr > tmp->last || addr + len - 1 < tmp->addr) continue;
+		tmp->pre_expr_val = data;
+		if(g_quiet){ quiet_stop(); continue; }  //反向执行的搜索只要暂停
+		nemu_state.state = NEMU_STOP;
+		hit = true;
+		hit_addr = addr;
+		printf("Watchpoint %d: %s\n", tmp->NO, tmp->expr);
+		printf("Written at " FMT_PADDR " (%d bytes) by pc = " FMT_WORD "\n", addr, len, cpu.pc);
+		printf("Old value = " FMT_WORD "\n", old);
+		printf("New value = " FMT_WORD "\n", data);
+	}
+}
+
+// 编译表达式并求初值
+static bool wp_compile(WP *wp){
+	if(wp_is_loc(wp->expr)){
+		char *end = NULL;
+		wp->addr = strtoull(wp->expr + 3, &end, 0);
+		word_t len = strtoull(end, &end, 0);
+		wp->last = wp->addr + len - 1;
+		wp->prog = NULL;
+		wp->pre_expr_val = 0;
+		return *end == '\0' && paddr_watch(wp->addr, len);
+	}
+	bool success = true;
+	wp->prog = expr_compile(wp->expr, &success);
+	if (!success) return false;
+	wp->pre_expr_val = expr_run(wp->prog);
+	return true;
+}
 
 void init_wp_pool() {
   int i;
@@ -37,29 +96,33 @@ void init_wp_pool() {
     wp_pool[i].NO = i;
     wp_pool[i].next = (i == NR_WP - 1 ? NULL : &wp_pool[i + 1]);
 		wp_pool[i].expr = NULL;
+		wp_pool[i].prog = NULL;
 		wp_pool[i].pre_expr_val = 0;
   }
 
   head = NULL;    //没有采用dummy，比较麻烦，需要判断head是否非空
   free_ = wp_pool;
+  g_nr_wp = 0;
+  paddr_unwatch_all();
+  paddr_set_watch_hook(wp_written);
 }
 
 /* TODO: Implement the functionality of watchpoint */
 
-void new_wp(char *e){                              //new_wp()从free_链表中返回一个空闲的监视点结构,
-	if(free_ == NULL) panic("No free watchpoints available");	
-
+static WP* wp_add(char *e){       //从free_链表中取出一个监视点并编译e, 失败时返回NULL, 不输出
+	if(free_ == NULL) return NULL;
 	WP *new_node = free_;
 	free_ = free_->next;
 
-	new_node->expr = strdup(e); 	                            //求表达式的值
-	bool success = true;
-	new_node->pre_expr_val = expr(e,&success);
-	if (!success) {
-		  panic("Failed to evaluate expression");
+	new_node->expr = strdup(e); 	                            //编译表达式并求值
+	if (!wp_compile(new_node)) {
+		free(new_node->expr);
+		new_node->expr = NULL;
+		new_node->next = free_;
+		free_ = new_node;
+		return NULL;
 	}
-	//test
-	printf("expr: %s\n", new_node->expr);			
+	if (new_node->prog != NULL) g_nr_wp++;
 
 	// 将新节点添加到 head 链表中
 	new_node->next = NULL;
@@ -72,27 +135,33 @@ void new_wp(char *e){                              //new_wp()从free_链表中
 		}
 		tmp->next = new_node;
 	}
+	return new_node;
 }
 
-void free_wp(int NO){            //free_wp()将wp归还到free_链表中
-	//test
-	printf("NO : %d\n", NO);
-	// 找到编号为 NO 的监视点
-	if (head == NULL) {
-		panic("No watchpoints to free");
-	}	
-	WP *wp = head;
-	while(wp != NULL && wp->NO != NO){
-		wp = wp->next;
+void new_wp(char *e){                              //new_wp()从free_链表中返回一个空闲的监视点结构,
+	if(free_ == NULL) panic("No free watchpoints available");	
+
+	WP *new_node = wp_add(e);
+	if (new_node == NULL) {
+		if (wp_is_loc(e)) {                                    //地址不在pmem中时不能监视
+			printf("Can not watch %s\n", e + 3);
+			return;
+		}
+		panic("Failed to evaluate expression");
 	}
-	if (wp == NULL) {
-	  panic("Watchpoint not found");
-  }
+	//test
+	printf("expr: %s\n", new_node->expr);			
+}
+
+static void wp_remove(WP *wp){   //把head中的wp归还到free_链表中
 	// 释放 expr 的内存
 	if (wp->expr != NULL) {
 		free(wp->expr);
 		wp->expr = NULL;
   }
+	if (wp->prog != NULL) g_nr_wp--;
+	expr_free(wp->prog);
+	wp->prog = NULL;
 	WP *tmp = head;                //从head中去除该wp
 	WP *pre = NULL;
 	while(tmp != NULL && tmp->NO != wp->NO){
@@ -101,6 +170,7 @@ void free_wp(int NO){            //free_wp()将wp归还到free_链表中
 	}
 	if(pre == NULL) head = tmp->next;   
 	else	pre->next = tmp->next;			
+	update_watch();                //被删除的可能是地址监视点
 	// 将该监视点归还到 free_ 链表中
 	if(free_ == NULL){             //1. free_ = NULL
 		free_ = wp;
@@ -125,21 +195,40 @@ void free_wp(int NO){            //free_wp()将wp归还到free_链表中
 	}	
 }
 
+void free_wp(int NO){            //free_wp()将wp归还到free_链表中
+	//test
+	printf("NO : %d\n", NO);
+	// 找到编号为 NO 的监视点
+	if (head == NULL) {
+		panic("No watchpoints to free");
+	}	
+	WP *wp = head;
+	while(wp != NULL && wp->NO != NO){
+		wp = wp->next;
+	}
+	if (wp == NULL) {
+	  panic("Watchpoint not found");
+  }
+	wp_remove(wp);
+}
+
 void traver_trace_diff(){
 	//test
 //	printf("here traver_trace_diff\n");
 	WP *tmp = head;
 	if(head == NULL) return;
 	while(tmp != NULL){
-		bool success = true;
-		word_t val = expr(tmp->expr,&success);
-		if(val != tmp->pre_expr_val){
+		//地址监视点不用求值, 表达式的输入没有变化时也不用重新求值
+		if(tmp->prog == NULL || !expr_update(tmp->prog)){ tmp = tmp->next; continue; }
+		word_t val = expr_run(tmp->prog);
+		if(val != tmp->pre_expr_val && g_quiet) quiet_stop();     //反向执行的搜索只要暂停
+		else if(val != tmp->pre_expr_val){
 			nemu_state.state = NEMU_STOP;
 			printf("Watchpoint %d: %s\n", tmp->NO, tmp->expr);
 			printf("Old value = %u\n", tmp->pre_expr_val);
 			printf("New value = %u\n", val);
-			tmp->pre_expr_val = val;
-		}			
+		}
+		tmp->pre_expr_val = val;
 		tmp = tmp->next;
 	}	
 }
@@ -148,8 +237,81 @@ void watchpoint_display(){
 	WP *tmp = head;
 	if(head == NULL){ printf("No watchpoint\n"); return; }
 	while(tmp != NULL){
-		printf("Watchpoint %d : %s value: %u\n", tmp->NO, tmp->expr, tmp->pre_expr_val);
+		if(tmp->prog == NULL) printf("Watchpoint %d : %s\n", tmp->NO, tmp->expr);
+		else printf("Watchpoint %d : %s value: %u\n", tmp->NO, tmp->expr, tmp->pre_expr_val);
 		tmp = tmp->next;
 	}	
 }
 
+
+bool wp_update(){                 //重新求值所有监视点, 返回是否有值发生变化, 不输出
+	bool changed = false;
+	for(WP *tmp = head; tmp != NULL; tmp = tmp->next){
+		if(tmp->prog == NULL || !expr_update(tmp->prog)) continue;
+		word_t val = expr_run(tmp->prog);
+		if(val != tmp->pre_expr_val) changed = true;
+		tmp->pre_expr_val = val;
+	}
+	return changed;
+}
+
+int wp_save(char *buf, int size){     //把监视点写成"NO EXPR\0"的序列, 用于快照之间传递, 返回长度
+	int len = 0;
+	for(WP *tmp = head; tmp != NULL; tmp = tmp->next){
+		int n = snprintf(buf + len, size - len, "%d %s", tmp->NO, tmp->expr) + 1;
+		if(len + n > size) break;
+		len += n;
+	}
+	return len;
+}
+
+void wp_restore(const char *buf, int len){    //用wp_save()的结果替换当前的监视点
+	for(int i = 0; i < NR_WP; i ++){ free(wp_pool[i].expr); expr_free(wp_pool[i].prog); }
+	init_wp_pool();
+	bool used[NR_WP] = {};
+	WP **tail = &head;
+	for(const char *p = buf; p < buf + len; p += strlen(p) + 1){
+		char *e = NULL;
+		int NO = strtol(p, &e, 10);
+		assert(NO >= 0 && NO < NR_WP);
+		WP *wp = &wp_pool[NO];
+		wp->expr = strdup(e + 1);
+		bool ok = wp_compile(wp);
+		assert(ok);
+		if(wp->prog != NULL) g_nr_wp++;
+		used[NO] = true;
+		*tail = wp;
+		tail = &wp->next;
+	}
+	*tail = NULL;
+	tail = &free_;                 //剩下的按编号顺序放回free_链表
+	for(int i = 0; i < NR_WP; i ++){
+		if(used[i]) continue;
+		*tail = &wp_pool[i];
+		tail = &wp_pool[i].next;
+	}
+	*tail = NULL;
+}
+
+bool wp_watch(paddr_t addr, word_t len){      //不输出地添加地址监视点, 用于gdb的Z2
+	char e[64];
+	snprintf(e, sizeof(e), "-l " FMT_PADDR " " FMT_WORD, addr, len);
+	return wp_add(e) != NULL;
+}
+
+bool wp_unwatch(paddr_t addr, word_t len){    //删除范围恰好为[addr, addr+len)的地址监视点
+	for(WP *tmp = head; tmp != NULL; tmp = tmp->next){
+		if(tmp->prog == NULL && tmp->addr == addr && tmp->last == addr + len - 1){
+			wp_remove(tmp);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool wp_last_hit(paddr_t *addr){          //上次运行是否触发了地址监视点, 读取后清除
+	bool ret = hit;
+	if(hit) *addr = hit_addr;
+	hit = false;
+	return ret;
+}
@@ -0,0 +1,309 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/btrace.h>
+#include <memory/mtrace.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+BTraceRecord btrace_ring[BTRACE_RING_SIZE] = {};
+uint64_t btrace_nr = 0;
+static char *ring_file = NULL;
+static uint64_t nr_streamed = 0;
+
+// ------------- compression, done by the writer thread -------------
+
+#define MAX_REC_SIZE (1 + 10 + 5 + 10) // tag, pc, instruction, result
+#define RAW_SIZE (BTRACE_RING_SIZE * MAX_REC_SIZE)
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 12
+
+static struct {
+  word_t pc;
+  uint32_t inst;
+  uint8_t len;
+} dict[BTRACE_DICT_SIZE];
+
+static uint8_t raw_buf[RAW_SIZE];
+static uint8_t lz_buf[RAW_SIZE + RAW_SIZE / 255 + 16];
+static uint32_t lz_table[1 << LZ_HASH_BITS];
+
+static int put_varint(uint8_t *p, uint64_t v) {
+  int n = 0;
+  for (; v >= 0x80; v >>= 7) p[n ++] = v | 0x80;
+  p[n ++] = v;
+  return n;
+}
+
+static uint64_t zigzag(word_t diff) {
+  int64_t d = (sword_t)diff;
+  return ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+}
+
+static size_t encode(BTraceRecord *rec, int nr) {
+  memset(dict, 0, sizeof(dict));
+  uint8_t *p = raw_buf;
+  word_t next_pc = 0, result = 0;
+  for (int i = 0; i < nr; i ++) {
+    BTraceRecord *r = &rec[i];
+    uint8_t *tag = p ++;
+    *tag = 0;
+    if (r->pc == next_pc) *tag |= BTRACE_TAG_SEQ;
+    else p += put_varint(p, zigzag(r->pc - next_pc));
+    int idx = BTRACE_DICT_IDX(r->pc);
+    if (dict[idx].pc == r->pc && dict[idx].inst == r->inst && dict[idx].len == r->len) {
+      *tag |= BTRACE_TAG_DICT;
+    } else {
+      memcpy(p, &r->inst, 4);
+      p[4] = r->len;
+      p += 5;
+      dict[idx].pc = r->pc;
+      dict[idx].inst = r->inst;
+      dict[idx].len = r->len;
+    }
+    if (r->has_result) {
+      *tag |= BTRACE_TAG_RESULT;
+      p += put_varint(p, zigzag(r->result - result));
+      result = r->result;
+    }
+    next_pc = r->pc + r->len;
+  }
+  return p - raw_buf;
+}
+
+static int put_len(uint8_t *p, size_t len) {
+  int n = 0;
+  for (; len >= 255; len -= 255) p[n ++] = 255;
+  p[n ++] = len;
+  return n;
+}
+
+// a run of literals followed by a match, if `match_len` is not 0
+static uint8_t* put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len,
+    size_t offset, size_t match_len) {
+  size_t ml = (match_len ? match_len - LZ_MIN_MATCH : 0);
+  *op ++ = ((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15);
+  if (lit_len >= 15) op += put_len(op, lit_len - 15);
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  if (match_len == 0) return op;
+  *op ++ = offset & 0xff;
+  *op ++ = offset >> 8;
+  if (ml >= 15) op += put_len(op, ml - 15);
+  return op;
+}
+
+// greedy LZ77 with a hash table of the last positions of 4-byte strings
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+  memset(lz_table, 0, sizeof(lz_table));
+  uint8_t *op = dst;
+  size_t ip = 0, anchor = 0;
+  while (ip + LZ_LAST_LITERALS < n) {
+    uint32_t seq;
+    memcpy(&seq, src + ip, 4);
+    uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+    size_t ref = lz_table[h];
+    lz_table[h] = ip + 1;
+    if (ref == 0 || ip + 1 - ref > 0xffff || memcmp(src + ref - 1, src + ip, 4) != 0) { ip ++; continue; }
+    ref --;
+    size_t len = LZ_MIN_MATCH;
+    while (ip + len + LZ_LAST_LITERALS < n && src[ref + len] == src[ip + len]) len ++;
+    op = put_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+    ip += len;
+    anchor = ip;
+  }
+  op = put_sequence(op, src + anchor, n - anchor, 0, 0);
+  return op - dst;
+}
+
+// ------------- the writer thread -------------
+
+#define NR_CHUNK 8
+
+typedef struct {
+  uint64_t first;
+  int nr;
+  FILE *fp; // not NULL for the records of the memory trace, which are written as they are
+  union {
+    BTraceRecord rec[BTRACE_RING_SIZE];
+    MTraceRecord mem[BTRACE_RING_SIZE];
+  };
+} Chunk;
+
+static FILE *trace_fp = NULL;
+static bool writer_on = false; // also started by the memory trace alone
+static Chunk *queue = NULL;
+static atomic_uint_fast64_t q_head = 0, q_tail = 0;
+static sem_t q_full, q_empty; // filled and free chunks
+static pthread_t writer;
+static BTraceIndex *index_tab = NULL;
+static uint64_t nr_block = 0;
+
+static void write_block(Chunk *c) {
+  size_t raw_size = encode(c->rec, c->nr);
+  BTraceBlock b = { .nr = c->nr, .raw_size = raw_size, .first = c->first };
+  b.size = lz_compress(raw_buf, raw_size, lz_buf);
+  if ((nr_block & (nr_block - 1)) == 0) {
+    index_tab = realloc(index_tab, sizeof(BTraceIndex) * (nr_block ? nr_block * 2 : 1));
+    assert(index_tab);
+  }
+  index_tab[nr_block ++] = (BTraceIndex) { .first = c->first, .offset = ftello(trace_fp) };
+  fwrite(&b, sizeof(b), 1, trace_fp);
+  fwrite(lz_buf, b.size, 1, trace_fp);
+}
+
+static void* btrace_writer(void *arg) {
+  while (true) {
+    sem_wait(&q_full);
+    Chunk *c = &queue[atomic_load(&q_tail) % NR_CHUNK];
+    if (c->nr == 0) break; // end of the trace
+    if (c->fp != NULL) fwrite(c->mem, sizeof(MTraceRecord), c->nr, c->fp);
+    else write_block(c);
+    atomic_fetch_add(&q_tail, 1);
+    sem_post(&q_empty);
+  }
+  return NULL;
+}
+
+// queue the records [from, to) still in the ring buffer
+static void push(uint64_t from, uint64_t to) {
+  sem_wait(&q_empty);
+  Chunk *c = &queue[atomic_load(&q_head) % NR_CHUNK];
+  c->first = from;
+  c->nr = to - from;
+  c->fp = NULL;
+  for (int i = 0; from < to; ) {
+    uint64_t idx = from % BTRACE_RING_SIZE;
+    uint64_t n = BTRACE_RING_SIZE - idx;
+    if (n > to - from) n = to - from;
+    memcpy(&c->rec[i], &btrace_ring[idx], sizeof(BTraceRecord) * n);
+    i += n;
+    from += n;
+  }
+  atomic_fetch_add(&q_head, 1);
+  sem_post(&q_full);
+}
+
+// queue the records of the memory trace, to be written to `fp`
+void btrace_push_mem(FILE *fp, const MTraceRecord *rec, int nr) {
+  assert(writer_on && nr <= BTRACE_RING_SIZE);
+  sem_wait(&q_empty);
+  Chunk *c = &queue[atomic_load(&q_head) % NR_CHUNK];
+  c->nr = nr;
+  c->fp = fp;
+  memcpy(c->mem, rec, sizeof(MTraceRecord) * nr);
+  atomic_fetch_add(&q_head, 1);
+  sem_post(&q_full);
+}
+
+// stream the records not written yet up to `to`
+static void stream(uint64_t to) {
+  uint64_t from = nr_streamed;
+  nr_streamed = to;
+  if (trace_fp == NULL) return;
+  if (from < CONFIG_TRACE_START) from = CONFIG_TRACE_START;
+  if (to > (uint64_t)CONFIG_TRACE_END + 1) to = (uint64_t)CONFIG_TRACE_END + 1;
+  if (from < to) push(from, to);
+}
+
+// the ring buffer is full, and the records are going to be overwritten
+void btrace_wrap() {
+  stream(btrace_nr);
+}
+
+// wait until all records so far are in the files
+void btrace_sync() {
+  stream(btrace_nr);
+  if (!writer_on) return;
+  while (atomic_load(&q_tail) != atomic_load(&q_head)) sched_yield();
+  if (trace_fp != NULL) fflush(trace_fp);
+}
+
+// only the calling thread survives fork(), so the child stops streaming
+static void btrace_fork_child() {
+  trace_fp = NULL;
+  writer_on = false;
+}
+
+void btrace_start_writer() {
+  if (writer_on) return;
+  queue = malloc(sizeof(Chunk) * NR_CHUNK);
+  assert(queue);
+  sem_init(&q_full, 0, 0);
+  sem_init(&q_empty, 0, NR_CHUNK);
+  Assert(pthread_create(&writer, NULL, btrace_writer, NULL) == 0, "fail to create the trace writer");
+  pthread_atfork(btrace_sync, NULL, btrace_fork_child);
+  writer_on = true;
+}
+
+static void btrace_exit() {
+  btrace_sync();
+  if (!writer_on) return;
+  // an empty chunk stops the writer
+  sem_wait(&q_empty);
+  queue[atomic_load(&q_head) % NR_CHUNK].nr = 0;
+  sem_post(&q_full);
+  pthread_join(writer, NULL);
+  writer_on = false;
+  if (trace_fp == NULL) return;
+  BTraceFooter f = { .nr_block = nr_block, .index_offset = ftello(trace_fp) };
+  memcpy(f.magic, BTRACE_INDEX_MAGIC, sizeof(f.magic));
+  fwrite(index_tab, sizeof(BTraceIndex), nr_block, trace_fp);
+  fwrite(&f, sizeof(f), 1, trace_fp);
+  fclose(trace_fp);
+  trace_fp = NULL;
+}
+
+// ------------- ring buffer dump -------------
+
+static void write_header(FILE *fp, uint64_t first, uint32_t flags) {
+  BTraceHeader h = { .version = BTRACE_VERSION, .rec_size = sizeof(BTraceRecord),
+    .word_size = sizeof(word_t), .first = first,
+    .flags = flags | MUXDEF(CONFIG_ISA_riscv, BTRACE_HAS_RESULT, 0) };
+  memcpy(h.magic, BTRACE_MAGIC, sizeof(h.magic));
+  strncpy(h.isa, str(__GUEST_ISA__), sizeof(h.isa) - 1);
+  fwrite(&h, sizeof(h), 1, fp);
+}
+
+// dump the last records for post-mortems
+void btrace_dump() {
+  btrace_sync();
+  uint64_t first = (btrace_nr > BTRACE_RING_SIZE ? btrace_nr - BTRACE_RING_SIZE : 0);
+  FILE *fp = fopen(ring_file, "wb");
+  if (fp == NULL) { perror(ring_file); return; }
+  write_header(fp, first, 0);
+  for (uint64_t i = first; i < btrace_nr; i ++) {
+    fwrite(&btrace_ring[i % BTRACE_RING_SIZE], sizeof(BTraceRecord), 1, fp);
+  }
+  fclose(fp);
+  Log("The last %" PRIu64 " instructions are dumped to %s", btrace_nr - first, ring_file);
+}
+
+void init_btrace(const char *file) {
+  if (file != NULL) {
+    trace_fp = fopen(file, "wb");
+    Assert(trace_fp, "Can not open '%s'", file);
+    write_header(trace_fp, CONFIG_TRACE_START, BTRACE_COMPRESSED);
+    btrace_start_writer();
+    Log("Binary instruction trace is written to %s", file);
+  }
+  const char *name = (file ? file : "nemu-btrace");
+  ring_file = malloc(strlen(name) + 6);
+  assert(ring_file);
+  sprintf(ring_file, "%s.ring", name);
+  atexit(btrace_exit);
+}
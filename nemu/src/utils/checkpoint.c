@@ -0,0 +1,207 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <utils.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <device/event.h>
+#include <cpu/difftest.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* A checkpoint file contains
+ *   CkptHeader | CPU_state | (CkptSection | data) * nr_section | pmem
+ * where pmem starts at a page-aligned offset. Zero pages and pages never
+ * touched by the guest are not written, so they become holes of the file.
+ * The map of touched pages is saved as a section by paddr. A checkpoint is
+ * restored by mapping its pmem image privately over pmem, which is copied
+ * on write.
+ */
+#define CKPT_MAGIC "NEMUCKPT"
+#define CKPT_VERSION 2
+#define MAX_SECTION 64
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  char isa[16];
+  uint64_t mbase, msize;
+  uint64_t nr_inst;
+  uint64_t cpu_size;
+  uint64_t nr_section;
+  uint64_t pmem_off;
+} CkptHeader;
+
+typedef struct {
+  char name[32];
+  uint64_t size;
+} CkptSection;
+
+typedef struct {
+  const char *name;
+  void *ptr;
+  size_t size;
+  void (*post_load)();
+} Section;
+
+static Section sections[MAX_SECTION] = {};
+static int nr_section = 0;
+
+extern uint64_t g_nr_guest_inst;
+
+void checkpoint_add(const char *name, void *ptr, size_t size, void (*post_load)()) {
+  Assert(nr_section < MAX_SECTION, "too many checkpoint sections");
+  Assert(strlen(name) < sizeof(((CkptSection *)0)->name), "name of checkpoint section is too long");
+  sections[nr_section ++] = (Section){ .name = name, .ptr = ptr, .size = size, .post_load = post_load };
+}
+
+static bool pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t ret = pwrite(fd, buf, len, off);
+    if (ret <= 0) return false;
+    buf = (const uint8_t *)buf + ret; len -= ret; off += ret;
+  }
+  return true;
+}
+
+static bool pread_all(int fd, void *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t ret = pread(fd, buf, len, off);
+    if (ret <= 0) return false;
+    buf = (uint8_t *)buf + ret; len -= ret; off += ret;
+  }
+  return true;
+}
+
+static bool is_zero_page(const uint8_t *p) {
+  const uint64_t *q = (const uint64_t *)p;
+  for (int i = 0; i < PAGE_SIZE / sizeof(uint64_t); i ++) { if (q[i] != 0) return false; }
+  return true;
+}
+
+static void init_header(CkptHeader *h) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, CKPT_MAGIC, sizeof(h->magic));
+  h->version = CKPT_VERSION;
+  strncpy(h->isa, str(__GUEST_ISA__), sizeof(h->isa) - 1);
+  h->mbase = CONFIG_MBASE;
+  h->msize = CONFIG_MSIZE;
+  h->cpu_size = sizeof(CPU_state);
+  h->nr_section = nr_section;
+}
+
+// The checkpoint is written to a temporary file and then renamed, so that
+// the file whose pmem image is currently mapped is never modified.
+bool checkpoint_save(const char *file) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) { perror(tmp); return false; }
+
+  CkptHeader h;
+  init_header(&h);
+  h.nr_inst = g_nr_guest_inst;
+  off_t off = sizeof(h) + sizeof(CPU_state);
+  for (int i = 0; i < nr_section; i ++) { off += sizeof(CkptSection) + sections[i].size; }
+  h.pmem_off = (off + PAGE_SIZE - 1) & ~(off_t)PAGE_MASK;
+
+  bool ok = pwrite_all(fd, &h, sizeof(h), 0) && pwrite_all(fd, &cpu, sizeof(cpu), sizeof(h));
+  off = sizeof(h) + sizeof(CPU_state);
+  for (int i = 0; ok && i < nr_section; i ++) {
+    CkptSection s = { .size = sections[i].size };
+    strncpy(s.name, sections[i].name, sizeof(s.name) - 1);
+    ok = pwrite_all(fd, &s, sizeof(s), off) &&
+      pwrite_all(fd, sections[i].ptr, s.size, off + sizeof(s));
+    off += sizeof(s) + s.size;
+  }
+  uint8_t *pmem = guest_to_host(CONFIG_MBASE);
+  for (size_t i = 0; ok && i < CONFIG_MSIZE; i += PAGE_SIZE) {
+    if (pmem_touched(CONFIG_MBASE + i) && !is_zero_page(pmem + i)) ok = pwrite_all(fd, pmem + i, PAGE_SIZE, h.pmem_off + i);
+  }
+  ok = ok && ftruncate(fd, h.pmem_off + CONFIG_MSIZE) == 0;
+  ok = (close(fd) == 0) && ok;
+  if (ok) ok = rename(tmp, file) == 0;
+  if (!ok) { perror(file); unlink(tmp); return false; }
+  Log("checkpoint saved to %s at %" PRIu64 " instructions", file, g_nr_guest_inst);
+  return true;
+}
+
+static bool check_header(CkptHeader *h) {
+  CkptHeader expect;
+  init_header(&expect);
+  return memcmp(h->magic, expect.magic, sizeof(h->magic)) == 0 &&
+    h->version == expect.version && strcmp(h->isa, expect.isa) == 0 &&
+    h->mbase == expect.mbase && h->msize == expect.msize &&
+    h->cpu_size == expect.cpu_size && h->nr_section == expect.nr_section;
+}
+
+// The map of touched pages is already restored with the sections.
+static bool load_pmem(int fd, off_t off) {
+  uint8_t *pmem = guest_to_host(CONFIG_MBASE);
+  if (((uintptr_t)pmem & PAGE_MASK) == 0) {
+    void *p = mmap(pmem, CONFIG_MSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, off);
+    if (p != MAP_FAILED) { pmem_remapped(); return true; }
+  }
+  pmem_remapped();
+  for (size_t i = 0; i < CONFIG_MSIZE; i += PAGE_SIZE) {
+    if (pmem_touched(CONFIG_MBASE + i) && !pread_all(fd, pmem + i, PAGE_SIZE, off + i)) return false;
+  }
+  return true;
+}
+
+bool checkpoint_load(const char *file) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) { perror(file); return false; }
+
+  CkptHeader h;
+  bool ok = pread_all(fd, &h, sizeof(h), 0) && check_header(&h);
+  // check the layout of all sections before modifying anything
+  off_t off = sizeof(h) + sizeof(CPU_state);
+  for (int i = 0; ok && i < nr_section; i ++) {
+    CkptSection s;
+    ok = pread_all(fd, &s, sizeof(s), off) && s.size == sections[i].size &&
+      strncmp(s.name, sections[i].name, sizeof(s.name)) == 0;
+    off += sizeof(s) + s.size;
+  }
+  if (!ok) {
+    printf("%s is not a checkpoint of this NEMU\n", file);
+    close(fd);
+    return false;
+  }
+
+  ok = pread_all(fd, &cpu, sizeof(cpu), sizeof(h));
+  off = sizeof(h) + sizeof(CPU_state);
+  for (int i = 0; ok && i < nr_section; i ++) {
+    ok = pread_all(fd, sections[i].ptr, sections[i].size, off + sizeof(CkptSection));
+    off += sizeof(CkptSection) + sections[i].size;
+  }
+  ok = ok && load_pmem(fd, h.pmem_off);
+  close(fd);
+  Assert(ok, "fail to load checkpoint %s, the machine state is broken", file);
+
+  g_nr_guest_inst = h.nr_inst;
+  IFDEF(CONFIG_DEVICE, event_reload(g_nr_guest_inst));
+  for (int i = 0; i < nr_section; i ++) {
+    if (sections[i].post_load) sections[i].post_load();
+  }
+  isa_mmu_flush();
+  difftest_reload();
+  nemu_state.state = NEMU_STOP;
+  Log("checkpoint loaded from %s at %" PRIu64 " instructions", file, g_nr_guest_inst);
+  return true;
+}
@@ -0,0 +1,196 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <utils.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The image file is mapped read-only. Whole pages of PT_LOAD segments are
+ * then mapped privately from the file over pmem, and whole pages of .bss
+ * are replaced by fresh anonymous pages, so both are brought in lazily by
+ * the host kernel. Only the partial pages at the ends are copied. Symbol
+ * names point into the mapping of the file, which is never unmapped.
+ */
+#ifdef CONFIG_ISA64
+typedef Elf64_Ehdr Elf_Ehdr;
+typedef Elf64_Phdr Elf_Phdr;
+typedef Elf64_Shdr Elf_Shdr;
+typedef Elf64_Sym  Elf_Sym;
+#define ELF_CLASS ELFCLASS64
+#define ELF_ST_TYPE ELF64_ST_TYPE
+#else
+typedef Elf32_Ehdr Elf_Ehdr;
+typedef Elf32_Phdr Elf_Phdr;
+typedef Elf32_Shdr Elf_Shdr;
+typedef Elf32_Sym  Elf_Sym;
+#define ELF_CLASS ELFCLASS32
+#define ELF_ST_TYPE ELF32_ST_TYPE
+#endif
+
+static Symbol *symtab = NULL;        // sorted by the address
+static Symbol **symtab_name = NULL;  // sorted by the name
+static int nr_symbol = 0;
+
+static void map_fixed(uint8_t *host, size_t len, int flags, int fd, off_t off) {
+  void *p = mmap(host, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | flags, fd, off);
+  Assert(p != MAP_FAILED, "fail to map the image into pmem");
+}
+
+// whether [off, off + len) is inside a file of `size` bytes
+static bool in_file(uint64_t off, uint64_t len, size_t size) {
+  return off <= size && len <= size - off;
+}
+
+static void load_segment(int fd, const uint8_t *file, size_t size, Elf_Phdr *ph) {
+  paddr_t addr = ph->p_paddr;
+  Assert(ph->p_filesz <= ph->p_memsz, "segment at " FMT_PADDR " has more bytes in the file than in memory", addr);
+  Assert(in_file(ph->p_offset, ph->p_filesz, size), "segment at " FMT_PADDR " is out of the file", addr);
+  Assert(in_pmem(addr) && in_pmem(addr + ph->p_memsz - 1),
+      "segment [" FMT_PADDR ", " FMT_PADDR ") is out of pmem", addr, (paddr_t)(addr + ph->p_memsz));
+  // the whole segment is copied or mapped below, so MEM_RANDOM only fills the pmem around it
+  pmem_prepare_overwrite(addr, ph->p_memsz);
+
+  uint8_t *host = guest_to_host(addr);
+  uint8_t *end = host + ph->p_filesz;
+  const uint8_t *src = file + ph->p_offset;
+  uint8_t *l = (uint8_t *)ROUNDUP(host, PAGE_SIZE), *r = (uint8_t *)ROUNDDOWN(end, PAGE_SIZE);
+  if (((uintptr_t)host - ph->p_offset) % PAGE_SIZE == 0 && l < r) {
+    map_fixed(l, r - l, 0, fd, ph->p_offset + (l - host));
+    memcpy(host, src, l - host);
+    memcpy(r, src + (r - host), end - r);
+  } else {
+    memcpy(host, src, ph->p_filesz);
+  }
+
+  uint8_t *bss_end = host + ph->p_memsz;
+  l = (uint8_t *)ROUNDUP(end, PAGE_SIZE);
+  r = (uint8_t *)ROUNDDOWN(bss_end, PAGE_SIZE);
+  if (l < r) {
+    map_fixed(l, r - l, MAP_ANONYMOUS, -1, 0);
+    memset(end, 0, l - end);
+    memset(r, 0, bss_end - r);
+  } else {
+    memset(end, 0, bss_end - end);
+  }
+}
+
+static int cmp_addr(const void *a, const void *b) {
+  vaddr_t x = ((const Symbol *)a)->addr, y = ((const Symbol *)b)->addr;
+  return (x > y) - (x < y);
+}
+
+static int cmp_name(const void *a, const void *b) {
+  return strcmp((*(Symbol * const *)a)->name, (*(Symbol * const *)b)->name);
+}
+
+static void load_symbols(const uint8_t *file, size_t size, Elf_Ehdr *eh) {
+  if (eh->e_shoff == 0) return;
+  Assert(in_file(eh->e_shoff, (uint64_t)eh->e_shnum * sizeof(Elf_Shdr), size),
+      "section headers are out of the file");
+  Elf_Shdr *sh = (Elf_Shdr *)(file + eh->e_shoff);
+  for (int i = 0; i < eh->e_shnum; i ++) {
+    if (sh[i].sh_type != SHT_SYMTAB) continue;
+    Assert(in_file(sh[i].sh_offset, sh[i].sh_size, size), "symbol table %d is out of the file", i);
+    Assert(sh[i].sh_link < eh->e_shnum, "symbol table %d links to no string table", i);
+    Elf_Shdr *str = &sh[sh[i].sh_link];
+    // the last string should end in the table
+    Assert(in_file(str->sh_offset, str->sh_size, size) && str->sh_size > 0 &&
+        file[str->sh_offset + str->sh_size - 1] == '\0', "string table %d is broken", sh[i].sh_link);
+    Elf_Sym *sym = (Elf_Sym *)(file + sh[i].sh_offset);
+    const char *strtab = (const char *)file + str->sh_offset;
+    int nr = sh[i].sh_size / sizeof(Elf_Sym);
+    symtab = realloc(symtab, sizeof(Symbol) * (nr_symbol + nr));
+    assert(symtab);
+    for (int j = 0; j < nr; j ++) {
+      int type = ELF_ST_TYPE(sym[j].st_info);
+      if ((type != STT_FUNC && type != STT_OBJECT) || sym[j].st_name == 0 ||
+          sym[j].st_shndx == SHN_UNDEF) continue;
+      Assert(sym[j].st_name < str->sh_size, "the name of symbol %d is out of the string table", j);
+      symtab[nr_symbol ++] = (Symbol) { .addr = sym[j].st_value, .size = sym[j].st_size,
+        .name = strtab + sym[j].st_name, .is_func = (type == STT_FUNC) };
+    }
+  }
+  if (nr_symbol == 0) return;
+  qsort(symtab, nr_symbol, sizeof(Symbol), cmp_addr);
+  symtab_name = malloc(sizeof(Symbol *) * nr_symbol);
+  assert(symtab_name);
+  for (int i = 0; i < nr_symbol; i ++) { symtab_name[i] = &symtab[i]; }
+  qsort(symtab_name, nr_symbol, sizeof(Symbol *), cmp_name);
+}
+
+long elf_load(const char *file_name) {
+  int fd = open(file_name, O_RDONLY);
+  Assert(fd >= 0, "Can not open '%s'", file_name);
+  struct stat st;
+  Assert(fstat(fd, &st) == 0, "Can not stat '%s'", file_name);
+  char magic[SELFMAG];
+  if (st.st_size < sizeof(Elf_Ehdr) || pread(fd, magic, SELFMAG, 0) != SELFMAG ||
+      memcmp(magic, ELFMAG, SELFMAG) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  const uint8_t *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  Assert(file != MAP_FAILED, "Can not map '%s'", file_name);
+  Elf_Ehdr *eh = (Elf_Ehdr *)file;
+  Assert(eh->e_ident[EI_CLASS] == ELF_CLASS, "'%s' is not an ELF%d file", file_name,
+      MUXDEF(CONFIG_ISA64, 64, 32));
+
+  Assert(in_file(eh->e_phoff, (uint64_t)eh->e_phnum * sizeof(Elf_Phdr), st.st_size),
+      "program headers are out of '%s'", file_name);
+  Elf_Phdr *ph = (Elf_Phdr *)(file + eh->e_phoff);
+  paddr_t hi = RESET_VECTOR;
+  int nr_seg = 0;
+  for (int i = 0; i < eh->e_phnum; i ++) {
+    if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) continue;
+    load_segment(fd, file, st.st_size, &ph[i]);
+    if (ph[i].p_paddr + ph[i].p_memsz > hi) hi = ph[i].p_paddr + ph[i].p_memsz;
+    nr_seg ++;
+  }
+  load_symbols(file, st.st_size, eh);
+  close(fd);
+
+  cpu.pc = eh->e_entry;
+  Log("The image is %s (ELF), %d segments, %d symbols, entry = " FMT_WORD,
+      file_name, nr_seg, nr_symbol, cpu.pc);
+  return hi - RESET_VECTOR;
+}
+
+// the symbol covering `addr`
+const Symbol* symbol_lookup(vaddr_t addr) {
+  // find the symbols starting at the greatest address not above `addr`
+  int l = 0, r = nr_symbol;
+  while (l < r) {
+    int mid = (l + r) / 2;
+    if (symtab[mid].addr <= addr) l = mid + 1;
+    else r = mid;
+  }
+  for (int i = l - 1; i >= 0 && symtab[i].addr == symtab[l - 1].addr; i --) {
+    if (addr - symtab[i].addr < symtab[i].size || addr == symtab[i].addr) return &symtab[i];
+  }
+  return NULL;
+}
+
+const Symbol* symbol_find(const char *name) {
+  Symbol key = { .name = name }, *pkey = &key;
+  Symbol **s = bsearch(&pkey, symtab_name, nr_symbol, sizeof(Symbol *), cmp_name);
+  return (s ? *s : NULL);
+}
@@ -22,3 +22,13 @@ src/utils/disasm.c: $(LIBCAPSTONE)
 $(LIBCAPSTONE):
 	$(MAKE) -C tools/capstone
 endif
+
+ifeq ($(CONFIG_BTRACE),)
+SRCS-BLACKLIST-y += src/utils/btrace.c
+endif
+
+ifeq ($(CONFIG_MTRACE),)
+SRCS-BLACKLIST-y += src/utils/mtrace.c
+endif
+
+SRCS-BLACKLIST-$(CONFIG_TARGET_AM) += src/utils/checkpoint.c src/utils/elf.c
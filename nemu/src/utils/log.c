@@ -18,20 +18,160 @@
 extern uint64_t g_nr_guest_inst;
 
 #ifndef CONFIG_TARGET_AM
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+
 FILE *log_fp = NULL;
 
+/* Records to a log file are formatted into a ring buffer of the calling
+ * thread, and written to the file by a background thread, so a thread
+ * calling log_write() never waits for the disk unless its buffer is
+ * full. The writer sleeps on `wakeup` when all buffers are empty. Logs
+ * to stdout are printed at once to keep their order with other output.
+ */
+#define LOG_BUF_SIZE (4 << 20)
+#define MAX_LOG_RING 4
+
+typedef struct {
+  char *buf;
+  atomic_size_t head; // moved by the owner thread
+  atomic_size_t tail; // moved by the writer thread
+} LogRing;
+
+static LogRing ring[MAX_LOG_RING] = {};
+static atomic_int nr_ring = 0;
+static __thread LogRing *my_ring = NULL;
+static bool async = false;
+static atomic_bool sleeping = false;
+static sem_t wakeup;
+
+static bool drain() {
+  bool busy = false;
+  for (int i = 0; i < nr_ring; i ++) {
+    LogRing *r = &ring[i];
+    size_t tail = atomic_load(&r->tail), head = atomic_load(&r->head);
+    while (tail != head) {
+      size_t off = tail % LOG_BUF_SIZE;
+      size_t len = head - tail;
+      if (len > LOG_BUF_SIZE - off) len = LOG_BUF_SIZE - off;
+      fwrite(r->buf + off, 1, len, log_fp);
+      tail += len;
+      atomic_store(&r->tail, tail);
+      busy = true;
+    }
+  }
+  return busy;
+}
+
+static bool all_empty() {
+  for (int i = 0; i < nr_ring; i ++) {
+    if (atomic_load(&ring[i].tail) != atomic_load(&ring[i].head)) return false;
+  }
+  return true;
+}
+
+static void* log_writer(void *arg) {
+  while (true) {
+    if (drain()) { fflush(log_fp); continue; }
+    atomic_store(&sleeping, true);
+    if (all_empty()) sem_wait(&wakeup);
+    atomic_store(&sleeping, false);
+  }
+  return NULL;
+}
+
+static void wake_writer() {
+  if (atomic_exchange(&sleeping, false)) sem_post(&wakeup);
+}
+
+// wait until the writer has written everything to the log file
+void log_flush() {
+  if (!async) { if (log_fp) fflush(log_fp); return; }
+  while (!all_empty()) { wake_writer(); sched_yield(); }
+  fflush(log_fp);
+}
+
+static void start_writer() {
+  pthread_t tid;
+  Assert(pthread_create(&tid, NULL, log_writer, NULL) == 0, "fail to create the log writer");
+  pthread_detach(tid);
+}
+
+static LogRing* new_ring() {
+  int i = atomic_fetch_add(&nr_ring, 1);
+  Assert(i < MAX_LOG_RING, "too many threads writing logs");
+  ring[i].buf = malloc(LOG_BUF_SIZE);
+  assert(ring[i].buf);
+  return &ring[i];
+}
+
+static void put(LogRing *r, const char *str, size_t len) {
+  size_t head = atomic_load(&r->head);
+  // wait for the writer if the buffer is full
+  while (head + len - atomic_load(&r->tail) > LOG_BUF_SIZE) { wake_writer(); sched_yield(); }
+  size_t off = head % LOG_BUF_SIZE;
+  size_t n = (len < LOG_BUF_SIZE - off ? len : LOG_BUF_SIZE - off);
+  memcpy(r->buf + off, str, n);
+  memcpy(r->buf, str + n, len - n);
+  atomic_store(&r->head, head + len);
+  wake_writer();
+}
+
+void log_printf(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  if (!async) {
+    vfprintf(log_fp, fmt, ap);
+    va_end(ap);
+    return;
+  }
+  char buf[512], *p = buf;
+  va_list ap2;
+  va_copy(ap2, ap);
+  int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  if (len >= sizeof(buf)) {
+    p = malloc(len + 1);
+    assert(p);
+    vsnprintf(p, len + 1, fmt, ap2);
+  }
+  va_end(ap2);
+  va_end(ap);
+  if (my_ring == NULL) my_ring = new_ring();
+  // a record larger than the buffer is written in pieces
+  for (int i = 0; i < len; i += LOG_BUF_SIZE) {
+    put(my_ring, p + i, (len - i < LOG_BUF_SIZE ? len - i : LOG_BUF_SIZE));
+  }
+  if (p != buf) free(p);
+}
+
 void init_log(const char *log_file) {
   log_fp = stdout;
   if (log_file != NULL) {
     FILE *fp = fopen(log_file, "w");
     Assert(fp, "Can not open '%s'", log_file);
     log_fp = fp;
+    async = true;
+    sem_init(&wakeup, 0, 0);
+    start_writer();
+    // only the calling thread survives fork(), so start another writer in the child
+    pthread_atfork(log_flush, NULL, start_writer);
+    atexit(log_flush);
   }
   Log("Log is written to %s", log_file ? log_file : "stdout");
 }
+static bool log_muted = false;
+
+void log_mute(bool mute) {
+  log_muted = mute;
+}
 
+// the counter is updated once per batch of instructions, and batches do
+// not cross the edges of the trace window (see batch_size()), so the
+// first instruction of the batch tells whether the window is open
 bool log_enable() {
-  return MUXDEF(CONFIG_TRACE, (g_nr_guest_inst >= CONFIG_TRACE_START) &&
-         (g_nr_guest_inst <= CONFIG_TRACE_END), false);
+  return !log_muted && MUXDEF(CONFIG_TRACE, (g_nr_guest_inst + 1 >= CONFIG_TRACE_START) &&
+         (g_nr_guest_inst + 1 <= CONFIG_TRACE_END), false);
 }
 #endif
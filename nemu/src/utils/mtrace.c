@@ -0,0 +1,133 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <memory/mtrace.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <cpu/btrace.h>
+#include <pthread.h>
+
+#define MAX_RANGE 16
+#define MAP_SIZE (1ull << MTRACE_MAP_BITS)
+
+typedef struct {
+  paddr_t start, end;
+  uint64_t nr; // number of accesses
+} Range;
+
+uint64_t mtrace_map[(1 << MTRACE_MAP_BITS) / 64] = {};
+static Range ranges[MAX_RANGE] = {};
+static int nr_range = 0;
+static FILE *trace_fp = NULL;   // written by the writer thread of the binary trace
+static MTraceRecord buf[BTRACE_RING_SIZE]; // records to be queued to the writer
+static int nr_buf = 0;
+static bool trace_forked = false; // the binary trace belongs to the parent
+
+static void set_map(paddr_t start, paddr_t end) {
+  uint64_t first = start >> PAGE_SHIFT, last = end >> PAGE_SHIFT;
+  if (last - first >= MAP_SIZE) { memset(mtrace_map, 0xff, sizeof(mtrace_map)); return; }
+  for (uint64_t pg = first; pg <= last; pg ++) {
+    uint32_t i = pg & (MAP_SIZE - 1);
+    mtrace_map[i / 64] |= 1ull << (i % 64);
+  }
+}
+
+// the pages of the ranges should not be cached in the soft TLB
+static void update_map() {
+  memset(mtrace_map, 0, sizeof(mtrace_map));
+  for (int i = 0; i < nr_range; i ++) set_map(ranges[i].start, ranges[i].end);
+  stlb_flush();
+}
+
+bool mtrace_add(paddr_t start, paddr_t end) {
+  if (nr_range == MAX_RANGE || start > end) return false;
+  ranges[nr_range ++] = (Range) { .start = start, .end = end };
+  update_map();
+  return true;
+}
+
+bool mtrace_del(int id) {
+  if (id < 0 || id >= nr_range) return false;
+  memmove(&ranges[id], &ranges[id + 1], sizeof(Range) * (nr_range - id - 1));
+  nr_range --;
+  update_map();
+  return true;
+}
+
+void mtrace_display() {
+  if (nr_range == 0) { printf("No memory range is traced\n"); return; }
+  for (int i = 0; i < nr_range; i ++) {
+    printf("%2d: [" FMT_PADDR ", " FMT_PADDR "] %" PRIu64 " accesses\n",
+        i, ranges[i].start, ranges[i].end, ranges[i].nr);
+  }
+}
+
+// the page is traced, check the ranges
+void mtrace_access(paddr_t addr, int len, word_t data, bool is_write) {
+  paddr_t last = addr + len - 1;
+  int i;
+  for (i = 0; i < nr_range; i ++) {
+    if (addr <= ranges[i].end && last >= ranges[i].start) break;
+  }
+  if (i == nr_range) return;
+  ranges[i].nr ++;
+
+  MTraceRecord r = { .addr = addr, .pc = cpu.pc, .data = data, .len = len,
+    .type = (is_write ? MTRACE_WRITE : 0) | (in_pmem(addr) ? 0 : MTRACE_MMIO) };
+  if (trace_fp != NULL) {
+    if (trace_forked) return;
+    buf[nr_buf ++] = r;
+    if (nr_buf == BTRACE_RING_SIZE) { btrace_push_mem(trace_fp, buf, nr_buf); nr_buf = 0; }
+    return;
+  }
+  log_write("mtrace: " FMT_WORD ": %c " FMT_PADDR " %d " FMT_WORD "%s\n", r.pc,
+      (is_write ? 'W' : 'R'), addr, len, data, (r.type & MTRACE_MMIO ? " mmio" : ""));
+}
+
+// wait until all records so far are in the file
+void mtrace_flush() {
+  if (trace_fp == NULL || trace_forked) return;
+  if (nr_buf > 0) { btrace_push_mem(trace_fp, buf, nr_buf); nr_buf = 0; }
+  btrace_sync();
+  fflush(trace_fp);
+}
+
+// the child of fork() should not write to the same file, so it drops the
+// records; its buffer of trace_fp is empty after mtrace_flush()
+static void mtrace_fork_child() {
+  trace_forked = true;
+}
+
+static void mtrace_exit() {
+  mtrace_flush();
+  if (trace_fp != NULL) fclose(trace_fp);
+  trace_fp = NULL;
+}
+
+void init_mtrace(const char *file) {
+  if (file == NULL) return;
+  trace_fp = fopen(file, "wb");
+  Assert(trace_fp, "Can not open '%s'", file);
+  BTraceHeader h = { .version = BTRACE_VERSION, .rec_size = sizeof(MTraceRecord),
+    .word_size = sizeof(word_t), .flags = BTRACE_MEM };
+  memcpy(h.magic, BTRACE_MAGIC, sizeof(h.magic));
+  strncpy(h.isa, str(__GUEST_ISA__), sizeof(h.isa) - 1);
+  fwrite(&h, sizeof(h), 1, trace_fp);
+  btrace_start_writer();
+  // registered after the writer, so that the prepare handler runs before its own
+  pthread_atfork(mtrace_flush, NULL, mtrace_fork_child);
+  atexit(mtrace_exit);
+  Log("Memory access trace is written to %s", file);
+}
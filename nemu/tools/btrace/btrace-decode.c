@@ -0,0 +1,319 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* Decode the binary instruction trace written by NEMU with CONFIG_BTRACE,
+ * either compressed or a dump of the ring buffer, and print one
+ * instruction per line:
+ *   index: pc: instruction  [disassembly]  [-> result]
+ * where the result is printed only for instructions writing a register.
+ * The instructions are disassembled if capstone is built in tools/capstone.
+ * The memory access trace of CONFIG_MTRACE is printed as
+ *   index: pc: R/W addr len data  [mmio]
+ *
+ * Usage: btrace-decode [-n N] FILE
+ *   -n N  skip to the N-th instruction (or memory access)
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#ifdef HAS_CAPSTONE
+#include <dlfcn.h>
+#include <capstone/capstone.h>
+#endif
+
+// the same as include/cpu/btrace.h
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t rec_size;
+  char isa[16];
+  uint32_t word_size;
+  uint32_t flags;
+  uint64_t first;
+} BTraceHeader;
+
+typedef struct {
+  uint32_t nr;
+  uint32_t raw_size;
+  uint32_t size;
+  uint32_t pad;
+  uint64_t first;
+} BTraceBlock;
+
+typedef struct {
+  uint64_t first;
+  uint64_t offset;
+} BTraceIndex;
+
+typedef struct {
+  uint64_t nr_block;
+  uint64_t index_offset;
+  char magic[8];
+} BTraceFooter;
+
+#define BTRACE_MAGIC "NEMUBTRC"
+#define BTRACE_INDEX_MAGIC "BTRCINDX"
+#define BTRACE_VERSION 3
+#define BTRACE_HAS_RESULT  1
+#define BTRACE_COMPRESSED  2
+#define BTRACE_MEM         4
+
+#define MTRACE_WRITE 1
+#define MTRACE_MMIO  2
+
+#define BTRACE_TAG_SEQ   1
+#define BTRACE_TAG_DICT  2
+#define BTRACE_TAG_RESULT 4
+#define BTRACE_DICT_SIZE 4096
+#define BTRACE_DICT_IDX(pc) (((pc) >> 1) % BTRACE_DICT_SIZE)
+
+static BTraceHeader h;
+
+#ifdef HAS_CAPSTONE
+static size_t (*cs_disasm_dl)(csh handle, const uint8_t *code,
+    size_t code_size, uint64_t address, size_t count, cs_insn **insn);
+static void (*cs_free_dl)(cs_insn *insn, size_t count);
+static csh handle;
+static bool has_disasm = false;
+
+static void init_disasm() {
+  const char *home = getenv("NEMU_HOME");
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/tools/capstone/repo/libcapstone.so.5", home ? home : ".");
+  void *dl = dlopen(path, RTLD_LAZY);
+  if (dl == NULL) return;
+  cs_err (*cs_open_dl)(cs_arch arch, cs_mode mode, csh *handle) = dlsym(dl, "cs_open");
+  cs_err (*cs_option_dl)(csh handle, cs_opt_type type, size_t value) = dlsym(dl, "cs_option");
+  cs_disasm_dl = dlsym(dl, "cs_disasm");
+  cs_free_dl = dlsym(dl, "cs_free");
+  if (!cs_open_dl || !cs_option_dl || !cs_disasm_dl || !cs_free_dl) return;
+
+  cs_arch arch; cs_mode mode;
+  if (strcmp(h.isa, "riscv32") == 0) { arch = CS_ARCH_RISCV; mode = CS_MODE_RISCV32 | CS_MODE_RISCVC; }
+  else if (strcmp(h.isa, "riscv64") == 0) { arch = CS_ARCH_RISCV; mode = CS_MODE_RISCV64 | CS_MODE_RISCVC; }
+  else if (strcmp(h.isa, "mips32") == 0) { arch = CS_ARCH_MIPS; mode = CS_MODE_MIPS32; }
+  else if (strcmp(h.isa, "loongarch32r") == 0) { arch = CS_ARCH_LOONGARCH; mode = CS_MODE_LOONGARCH32; }
+  else if (strcmp(h.isa, "x86") == 0) { arch = CS_ARCH_X86; mode = CS_MODE_32; }
+  else return;
+  if (cs_open_dl(arch, mode, &handle) != CS_ERR_OK) return;
+  if (arch == CS_ARCH_X86) cs_option_dl(handle, CS_OPT_SYNTAX, CS_OPT_SYNTAX_ATT);
+  has_disasm = true;
+}
+
+static void disassemble(char *str, int size, uint64_t pc, uint32_t inst) {
+  str[0] = '\0';
+  if (!has_disasm) return;
+  cs_insn *insn;
+  size_t count = cs_disasm_dl(handle, (uint8_t *)&inst, sizeof(inst), pc, 1, &insn);
+  if (count == 0) { snprintf(str, size, "(unknown)"); return; }
+  snprintf(str, size, "%s\t%s", insn->mnemonic, insn->op_str);
+  cs_free_dl(insn, count);
+}
+#else
+static void init_disasm() { }
+static void disassemble(char *str, int size, uint64_t pc, uint32_t inst) { str[0] = '\0'; }
+#endif
+
+static uint64_t get_word(const uint8_t *p) {
+  uint64_t w = 0;
+  memcpy(&w, p, h.word_size);
+  return w;
+}
+
+static uint64_t word_mask() {
+  return (h.word_size == 8 ? ~0ull : (1ull << (h.word_size * 8)) - 1);
+}
+
+static void print_record(uint64_t idx, uint64_t pc, uint32_t inst, bool has_result, uint64_t result) {
+  char buf[256];
+  int fmt_len = h.word_size * 2;
+  disassemble(buf, sizeof(buf), pc, inst);
+  printf("%10lu: 0x%0*lx: %08x", (unsigned long)idx, fmt_len, (unsigned long)pc, inst);
+  if (buf[0] != '\0') printf("  %-32s", buf);
+  if (has_result) printf("  -> 0x%0*lx", fmt_len, (unsigned long)result);
+  printf("\n");
+}
+
+static void decode_raw(FILE *fp, uint64_t skip) {
+  // records have a fixed size, so seek to the N-th one directly
+  uint64_t idx = h.first;
+  if (skip > idx) {
+    if (fseeko(fp, sizeof(h) + (skip - idx) * h.rec_size, SEEK_SET) != 0) { perror("fseek"); exit(1); }
+    idx = skip;
+  }
+  uint8_t rec[64];
+  for (; fread(rec, h.rec_size, 1, fp) == 1; idx ++) {
+    uint32_t inst;
+    memcpy(&inst, rec + h.word_size, sizeof(inst));
+    // has_result follows pc, inst and len
+    bool has_result = (h.flags & BTRACE_HAS_RESULT) && rec[h.word_size + 5];
+    print_record(idx, get_word(rec), inst, has_result, get_word(rec + h.rec_size - h.word_size));
+  }
+}
+
+// the same layout as MTraceRecord in include/memory/mtrace.h
+static void decode_mem(FILE *fp, uint64_t skip) {
+  if (skip > 0 && fseeko(fp, sizeof(h) + skip * h.rec_size, SEEK_SET) != 0) { perror("fseek"); exit(1); }
+  int fmt_len = h.word_size * 2;
+  uint8_t rec[64];
+  for (uint64_t idx = skip; fread(rec, h.rec_size, 1, fp) == 1; idx ++) {
+    uint64_t addr;
+    memcpy(&addr, rec, sizeof(addr));
+    uint8_t *p = rec + sizeof(addr) + h.word_size * 2;
+    printf("%10lu: 0x%0*lx: %c 0x%08lx %d 0x%0*lx%s\n", (unsigned long)idx,
+        fmt_len, (unsigned long)get_word(rec + sizeof(addr)), (p[1] & MTRACE_WRITE ? 'W' : 'R'),
+        (unsigned long)addr, p[0], fmt_len, (unsigned long)get_word(rec + sizeof(addr) + h.word_size),
+        (p[1] & MTRACE_MMIO ? "  mmio" : ""));
+  }
+}
+
+static bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t size) {
+  const uint8_t *ip = src, *end = src + n;
+  uint8_t *op = dst, *op_end = dst + size;
+  int c;
+  while (ip < end) {
+    int token = *ip ++;
+    size_t lit = token >> 4;
+    if (lit == 15) do { if (ip >= end) return false; c = *ip ++; lit += c; } while (c == 255);
+    if (lit > end - ip || lit > op_end - op) return false;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    // the last sequence has no match
+    if (ip == end) break;
+    if (end - ip < 2) return false;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t len = (token & 15) + 4;
+    if ((token & 15) == 15) do { if (ip >= end) return false; c = *ip ++; len += c; } while (c == 255);
+    if (offset == 0 || offset > op - dst || len > op_end - op) return false;
+    // the match may overlap the output, so copy byte by byte
+    for (; len > 0; len --, op ++) *op = op[-offset];
+  }
+  return op == op_end;
+}
+
+static uint64_t get_varint(const uint8_t **p) {
+  uint64_t v = 0;
+  for (int shift = 0; ; shift += 7) {
+    uint8_t c = *(*p) ++;
+    v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) return v;
+  }
+}
+
+static uint64_t unzigzag(uint64_t v) {
+  return (v >> 1) ^ -(v & 1);
+}
+
+static bool decode_block(FILE *fp, uint64_t skip) {
+  static struct { uint64_t pc; uint32_t inst; uint8_t len; } dict[BTRACE_DICT_SIZE];
+  BTraceBlock b;
+  if (fread(&b, sizeof(b), 1, fp) != 1 || b.nr == 0) return false;
+  uint8_t *lz = malloc(b.size), *raw = malloc(b.raw_size);
+  assert(lz && raw);
+  bool ok = fread(lz, b.size, 1, fp) == 1 && lz_decompress(lz, b.size, raw, b.raw_size);
+  if (!ok) {
+    // the last block may be cut off if NEMU crashed while writing it
+    fprintf(stderr, "block at instruction %lu is broken\n", (unsigned long)b.first);
+    free(lz);
+    free(raw);
+    return false;
+  }
+
+  memset(dict, 0, sizeof(dict));
+  const uint8_t *p = raw;
+  uint64_t next_pc = 0, result = 0, mask = word_mask();
+  for (uint32_t i = 0; i < b.nr; i ++) {
+    int tag = *p ++;
+    uint64_t pc = next_pc;
+    if (!(tag & BTRACE_TAG_SEQ)) pc = (next_pc + unzigzag(get_varint(&p))) & mask;
+    int idx = BTRACE_DICT_IDX(pc);
+    if (!(tag & BTRACE_TAG_DICT)) {
+      dict[idx].pc = pc;
+      memcpy(&dict[idx].inst, p, 4);
+      dict[idx].len = p[4];
+      p += 5;
+    }
+    if (tag & BTRACE_TAG_RESULT) result = (result + unzigzag(get_varint(&p))) & mask;
+    if (b.first + i >= skip) print_record(b.first + i, pc, dict[idx].inst, tag & BTRACE_TAG_RESULT, result);
+    next_pc = (pc + dict[idx].len) & mask;
+  }
+  free(lz);
+  free(raw);
+  return true;
+}
+
+static void decode_compressed(FILE *fp, uint64_t skip) {
+  // the index is missing if NEMU did not exit normally,
+  // then scan the blocks from the beginning
+  off_t end = -1;
+  BTraceFooter f;
+  if (fseeko(fp, -(off_t)sizeof(f), SEEK_END) == 0 && fread(&f, sizeof(f), 1, fp) == 1 &&
+      memcmp(f.magic, BTRACE_INDEX_MAGIC, sizeof(f.magic)) == 0) {
+    end = f.index_offset;
+  }
+  off_t start = sizeof(h);
+  if (end != -1 && f.nr_block > 0 && skip > h.first) {
+    // binary search for the last block starting at or before the N-th instruction
+    BTraceIndex *idx = malloc(sizeof(BTraceIndex) * f.nr_block);
+    assert(idx);
+    if (fseeko(fp, f.index_offset, SEEK_SET) != 0 || fread(idx, sizeof(BTraceIndex), f.nr_block, fp) != f.nr_block) {
+      fprintf(stderr, "the index is broken\n");
+      exit(1);
+    }
+    uint64_t l = 0, r = f.nr_block;
+    while (r - l > 1) {
+      uint64_t m = (l + r) / 2;
+      if (idx[m].first <= skip) l = m;
+      else r = m;
+    }
+    start = idx[l].offset;
+    free(idx);
+  }
+  fseeko(fp, start, SEEK_SET);
+  while ((end == -1 || ftello(fp) < end) && decode_block(fp, skip)) ;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t skip = 0;
+  int o;
+  while ((o = getopt(argc, argv, "n:")) != -1) {
+    if (o == 'n') skip = strtoull(optarg, NULL, 0);
+    else { fprintf(stderr, "Usage: %s [-n N] FILE\n", argv[0]); return 1; }
+  }
+  if (optind != argc - 1) { fprintf(stderr, "Usage: %s [-n N] FILE\n", argv[0]); return 1; }
+
+  FILE *fp = fopen(argv[optind], "rb");
+  if (fp == NULL) { perror(argv[optind]); return 1; }
+  if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, BTRACE_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != BTRACE_VERSION || (h.word_size != 4 && h.word_size != 8) ||
+      h.rec_size < h.word_size * 2 + 4 || h.rec_size > 64) {
+    fprintf(stderr, "%s is not a binary trace of NEMU\n", argv[optind]);
+    return 1;
+  }
+  init_disasm();
+
+  if (h.flags & BTRACE_MEM) decode_mem(fp, skip);
+  else if (h.flags & BTRACE_COMPRESSED) decode_compressed(fp, skip);
+  else decode_raw(fp, skip);
+  fclose(fp);
+  return 0;
+}
@@ -0,0 +1,298 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* Read the INSTPAT tables of an ISA's inst.c and generate a decision tree
+ * for each INSTPAT_START() block. The tree returns the line number of the
+ * first pattern (in source order) matching the instruction, which is used
+ * as a `case` label by INSTPAT() in include/cpu/decode.h. Therefore the
+ * result is the same as trying the patterns one by one.
+ *
+ * Usage: gen-decode inst.c > isa-decode-tree.h
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#define MAX_PAT 1024
+#define MAX_BLOCK 16
+
+typedef struct {
+  uint64_t key, mask;
+  int line;
+  char name[32];
+} Pattern;
+
+typedef struct {
+  int line; // line of INSTPAT_START()
+  int start, nr_pat;
+} Block;
+
+static Pattern pats[MAX_PAT] = {};
+static int nr_pat = 0;
+static Block blocks[MAX_BLOCK] = {};
+static int nr_block = 0;
+
+static const char *file_name = NULL;
+static char *src = NULL;
+
+static void error(int line, const char *msg) {
+  fprintf(stderr, "%s:%d: %s\n", file_name, line, msg);
+  exit(1);
+}
+
+static char* load_file(const char *name) {
+  FILE *fp = fopen(name, "r");
+  if (fp == NULL) { perror(name); exit(1); }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *buf = malloc(size + 1);
+  assert(buf);
+  int ret = fread(buf, size, 1, fp);
+  assert(size == 0 || ret == 1);
+  buf[size] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+// replace comments and preprocessor directives with spaces, keep newlines
+static void strip(char *p) {
+  bool line_start = true;
+  while (*p) {
+    if (line_start && *p == '#') {
+      for (; *p && *p != '\n'; p ++) {
+        if (p[0] == '\\' && p[1] == '\n') { *p = ' '; p ++; }
+        else { *p = ' '; }
+      }
+      continue;
+    }
+    if (p[0] == '/' && p[1] == '/') {
+      for (; *p && *p != '\n'; p ++) *p = ' ';
+      continue;
+    }
+    if (p[0] == '/' && p[1] == '*') {
+      for (; *p && !(p[0] == '*' && p[1] == '/'); p ++) { if (*p != '\n') *p = ' '; }
+      if (*p) { p[0] = p[1] = ' '; p += 2; }
+      continue;
+    }
+    if (*p == '"' || *p == '\'') {
+      char quote = *p ++;
+      for (; *p && *p != quote && *p != '\n'; p ++) { if (*p == '\\' && p[1]) p ++; }
+      if (*p == quote) p ++;
+      line_start = false;
+      continue;
+    }
+    if (*p == '\n') line_start = true;
+    else if (!isspace((unsigned char)*p)) line_start = false;
+    p ++;
+  }
+}
+
+static int line_of(const char *p) {
+  int line = 1;
+  for (const char *q = src; q < p; q ++) { if (*q == '\n') line ++; }
+  return line;
+}
+
+static const char* skip_space(const char *p) {
+  while (isspace((unsigned char)*p)) p ++;
+  return p;
+}
+
+static bool is_ident(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+// match the identifier `id` followed by '('
+static const char* match_call(const char *p, const char *id) {
+  int len = strlen(id);
+  if (strncmp(p, id, len) != 0 || is_ident(p[len])) return NULL;
+  if (p > src && is_ident(p[-1])) return NULL;
+  p = skip_space(p + len);
+  return (*p == '(' ? p + 1 : NULL);
+}
+
+static void parse_pattern(const char *p, int line) {
+  if (nr_pat == MAX_PAT) error(line, "too many patterns");
+  Pattern *pat = &pats[nr_pat];
+  p = skip_space(p);
+  if (*p != '"') error(line, "the pattern should be a string literal");
+  int nr_bit = 0;
+  for (p ++; *p != '"'; p ++) {
+    switch (*p) {
+      case ' ': continue;
+      case '0': case '1': case '?': break;
+      default: error(line, "invalid character in pattern string");
+    }
+    if (++ nr_bit > 64) error(line, "pattern too long");
+    pat->key  = (pat->key  << 1) | (*p == '1');
+    pat->mask = (pat->mask << 1) | (*p != '?');
+  }
+  p = skip_space(p + 1);
+  if (*p == ',') {
+    p = skip_space(p + 1);
+    int i;
+    for (i = 0; i < sizeof(pat->name) - 1 && *p != ',' && *p != ')' && !isspace((unsigned char)*p); i ++) {
+      pat->name[i] = *p ++;
+    }
+  }
+  pat->line = line;
+  nr_pat ++;
+}
+
+static void parse() {
+  char *text = strdup(src);
+  assert(text);
+  strip(text);
+
+  Block *cur = NULL;
+  for (const char *p = text; *p; p ++) {
+    const char *q;
+    if ((q = match_call(p, "INSTPAT_START")) != NULL) {
+      int line = line_of(src + (p - text));
+      if (cur != NULL) error(line, "nested INSTPAT_START()");
+      if (nr_block == MAX_BLOCK) error(line, "too many INSTPAT_START()");
+      cur = &blocks[nr_block ++];
+      cur->line = line;
+      cur->start = nr_pat;
+    } else if ((q = match_call(p, "INSTPAT_END")) != NULL) {
+      if (cur == NULL) error(line_of(src + (p - text)), "INSTPAT_END() without INSTPAT_START()");
+      cur->nr_pat = nr_pat - cur->start;
+      cur = NULL;
+    } else if ((q = match_call(p, "INSTPAT")) != NULL) {
+      int line = line_of(src + (p - text));
+      if (cur == NULL) error(line, "INSTPAT() outside INSTPAT_START()");
+      // the pattern string is parsed from the original text
+      parse_pattern(src + (q - text), line);
+    }
+  }
+  if (cur != NULL) error(cur->line, "INSTPAT_START() without INSTPAT_END()");
+  free(text);
+}
+
+static void indent(int depth) {
+  printf("%*s", depth * 2 + 2, "");
+}
+
+/* Emit the code to find the first matching pattern in `cand[0..n)`.
+ * All bits in `tested` are already checked, and every candidate agrees
+ * with the instruction on these bits.
+ */
+static void emit(const int *cand, int n, uint64_t tested, int depth) {
+  int i, j;
+  // patterns after the first one without untested bits can never match
+  for (i = 0; i < n; i ++) {
+    if ((pats[cand[i]].mask & ~tested) == 0) { n = i + 1; break; }
+  }
+  if (n == 0) { indent(depth); printf("return -1;\n"); return; }
+
+  Pattern *p0 = &pats[cand[0]];
+  if ((p0->mask & ~tested) == 0) {
+    indent(depth); printf("return %d; // %s\n", p0->line, p0->name);
+    return;
+  }
+
+  bool has_tail = (pats[cand[n - 1]].mask & ~tested) == 0;
+  int nr_fix = n - has_tail;
+  uint64_t common = ~tested;
+  for (i = 0; i < nr_fix; i ++) { common &= pats[cand[i]].mask; }
+
+  int *sub = malloc(sizeof(int) * n);
+  assert(sub);
+
+  if (common != 0) {
+    // switch on the bits fixed by all candidates
+    indent(depth); printf("switch (inst & 0x%llxull) {\n", (unsigned long long)common);
+    for (i = 0; i < nr_fix; i ++) {
+      uint64_t val = pats[cand[i]].key & common;
+      bool seen = false;
+      for (j = 0; j < i; j ++) { if ((pats[cand[j]].key & common) == val) { seen = true; break; } }
+      if (seen) continue;
+      int nr_sub = 0;
+      for (j = i; j < n; j ++) {
+        if (j >= nr_fix || (pats[cand[j]].key & common) == val) sub[nr_sub ++] = cand[j];
+      }
+      indent(depth); printf("case 0x%llxull:\n", (unsigned long long)val);
+      emit(sub, nr_sub, tested | common, depth + 1);
+    }
+    indent(depth); printf("default:\n");
+    emit(cand + nr_fix, n - nr_fix, tested | common, depth + 1);
+    indent(depth); printf("}\n");
+  } else {
+    // split on the bit fixed by the most candidates
+    uint64_t bit = 0;
+    int best = 0;
+    for (int b = 0; b < 64; b ++) {
+      uint64_t m = 1ull << b;
+      if (tested & m) continue;
+      int cnt = 0;
+      for (i = 0; i < nr_fix; i ++) { cnt += (pats[cand[i]].mask & m) != 0; }
+      if (cnt > best) { best = cnt; bit = m; }
+    }
+    if (best >= 2) {
+      for (int side = 1; side >= 0; side --) {
+        int nr_sub = 0;
+        for (j = 0; j < n; j ++) {
+          Pattern *p = &pats[cand[j]];
+          if (!(p->mask & bit) || ((p->key & bit) != 0) == side) sub[nr_sub ++] = cand[j];
+        }
+        indent(depth);
+        if (side) printf("if (inst & 0x%llxull) {\n", (unsigned long long)bit);
+        else printf("} else {\n");
+        emit(sub, nr_sub, tested | bit, depth + 1);
+      }
+      indent(depth); printf("}\n");
+    } else {
+      // nothing in common, test the first candidate directly
+      uint64_t m = p0->mask & ~tested;
+      indent(depth);
+      printf("if ((inst & 0x%llxull) == 0x%llxull) return %d; // %s\n",
+          (unsigned long long)m, (unsigned long long)(p0->key & m), p0->line, p0->name);
+      emit(cand + 1, n - 1, tested, depth);
+    }
+  }
+  free(sub);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s inst.c\n", argv[0]);
+    return 1;
+  }
+  file_name = argv[1];
+  src = load_file(file_name);
+  parse();
+
+  printf("// Generated by tools/gen-decode from %s. DO NOT EDIT.\n\n", file_name);
+  printf("#ifndef __ISA_DECODE_TREE_H__\n#define __ISA_DECODE_TREE_H__\n\n#include <stdint.h>\n");
+  for (int i = 0; i < nr_block; i ++) {
+    Block *b = &blocks[i];
+    int *cand = malloc(sizeof(int) * (b->nr_pat + 1));
+    assert(cand);
+    for (int j = 0; j < b->nr_pat; j ++) cand[j] = b->start + j;
+    printf("\n// INSTPAT_START() at line %d, %d patterns\n", b->line, b->nr_pat);
+    printf("static inline int __instpat_tree_%d(uint64_t inst) {\n", b->line);
+    emit(cand, b->nr_pat, 0, 0);
+    printf("}\n");
+    free(cand);
+  }
+  printf("\n#endif\n");
+  return 0;
+}